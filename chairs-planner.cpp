@@ -3,19 +3,59 @@
 #include <sstream>
 
 #include <algorithm>
+#include <cmath>
+#include <csignal>
+#include <filesystem>
+#include <functional>
 #include <array>
 #include <vector>
-#include <set>
 #include <queue>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
-#include <regex>
 #include <string>
+#include <string_view>
 #include <stdexcept>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(CHAIRS_WITH_ZLIB)
+#include <zlib.h>
+#endif
 
 #include "test.hpp"
 
 constexpr auto ChairTypes = std::array{ 'W', 'P', 'S', 'C' };
 constexpr auto WallTypes = std::array{ '+', '-', '|', '\\', '/', '\n' };
+constexpr auto DoorTypes = std::array{ 'D' };
 constexpr auto Visited = 'X';
 
 int chair_type(char c) {
@@ -37,186 +77,6114 @@ std::string trim(std::string str) {
     return std::string{beg, end};
 }
 
-struct Pos {
-    ssize_t x = 0;
-    ssize_t y = 0;
-    std::string str() const {
-        return "(" + std::to_string(x) + ", " + std::to_string(y) + ")";
+// Phases of the plan processing for time and allocation accounting
+enum class Phase : uint8_t { Other, Read, Rooms, Fill, Sort, Output };
+constexpr auto PhaseNames = std::array{ "other", "read", "rooms", "fill", "sort", "output" };
+
+struct PhaseStats {
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<int64_t> current{0}; // allocated bytes not freed yet
+    std::atomic<int64_t> peak{0};
+};
+std::array<PhaseStats, PhaseNames.size()> phase_stats;
+std::atomic<bool> stats_enabled{false}; // phase time accounting
+
+// Set the current phase of the thread for the scope lifetime,
+// time and allocations are accounted to the current phase
+class PhaseScope {
+private:
+    static thread_local Phase current;
+    static thread_local std::chrono::steady_clock::time_point since;
+    static thread_local std::array<uint64_t, PhaseNames.size()> elapsed; // nanoseconds
+    const Phase previous;
+public:
+    explicit PhaseScope(Phase phase)
+        : previous(current)
+    {
+        switch_to(phase);
     }
 
-    // for tests
-    bool operator==(const Pos& other) const {
-        return this->x == other.x && this->y == other.y;
+    ~PhaseScope() {
+        switch_to(previous);
     }
-    friend std::ostream& operator<<(std::ostream& os, const Pos& pos) {
-        return os << "(" << pos.x << ", " << pos.y << ")";
+
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+
+    static Phase phase() {
+        return current;
+    }
+
+    // time spent by the thread in the phase
+    static uint64_t nanoseconds(Phase phase) {
+        return elapsed[static_cast<size_t>(phase)];
+    }
+private:
+    static void switch_to(Phase phase) {
+        if (stats_enabled.load(std::memory_order_relaxed)) {
+            const auto now = std::chrono::steady_clock::now();
+            if (since != std::chrono::steady_clock::time_point{}) {
+                elapsed[static_cast<size_t>(current)] += (now - since).count();
+            }
+            since = now;
+        }
+        current = phase;
     }
 };
+thread_local Phase PhaseScope::current = Phase::Other;
+thread_local std::chrono::steady_clock::time_point PhaseScope::since;
+thread_local std::array<uint64_t, PhaseNames.size()> PhaseScope::elapsed;
 
-using ChairCount = std::array<size_t, std::size(ChairTypes)>;
+#if defined(CHAIRS_ALLOC_STATS)
+// Allocation header keeps the size and the phase for operator delete
+struct alignas(std::max_align_t) AllocHeader {
+    size_t size;
+    Phase phase;
+};
 
-struct Room {
-    std::string name;
-    Pos pos;
-    ChairCount chairs{};
+void* operator new(size_t size) {
+    auto* header = static_cast<AllocHeader*>(std::malloc(sizeof(AllocHeader) + size));
+    if (!header) {
+        throw std::bad_alloc();
+    }
+    header->size = size;
+    header->phase = PhaseScope::phase();
+    auto& stats = phase_stats[static_cast<size_t>(header->phase)];
+    stats.allocations.fetch_add(1, std::memory_order_relaxed);
+    stats.bytes.fetch_add(size, std::memory_order_relaxed);
+    const int64_t current = stats.current.fetch_add(size, std::memory_order_relaxed) + size;
+    for (int64_t peak = stats.peak.load(std::memory_order_relaxed);
+        current > peak && !stats.peak.compare_exchange_weak(peak, current, std::memory_order_relaxed);) {
+    }
+    return header + 1;
+}
 
-    Room(const std::string& name, const Pos& pos = {}, const ChairCount& chairs = {})
-        : name(name), pos(pos), chairs(chairs)
+void operator delete(void* ptr) noexcept {
+    if (ptr) {
+        auto* header = static_cast<AllocHeader*>(ptr) - 1;
+        phase_stats[static_cast<size_t>(header->phase)].current.fetch_sub(header->size, std::memory_order_relaxed);
+        std::free(header);
+    }
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+#endif
+
+// Parse a sysfs CPU list like "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::istringstream in(list);
+    for (std::string range; std::getline(in, range, ',');) {
+        int first = 0, last = 0;
+        char dash = 0;
+        std::istringstream item(range);
+        if (item >> first) {
+            last = (item >> dash >> last && dash == '-' ? last : first);
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+// Allowed CPUs of each NUMA node with any, a single node of all allowed CPUs
+// on machines without NUMA information
+std::vector<std::vector<int>> numa_nodes() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (::sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return {};
+    }
+    std::vector<std::vector<int>> nodes;
+    for (int node = 0;; ++node) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!std::getline(file, list)) {
+            break;
+        }
+        std::vector<int> cpus = parse_cpu_list(list);
+        cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+            [&allowed](int cpu) { return cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed); }), cpus.end());
+        if (!cpus.empty()) {
+            nodes.push_back(std::move(cpus));
+        }
+    }
+    if (nodes.empty()) {
+        nodes.emplace_back();
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                nodes.back().push_back(cpu);
+            }
+        }
+    }
+    return nodes;
+}
+
+struct ThreadPlacement {
+    size_t worker;
+    int cpu; // where the worker started, -1 if unknown
+    int node;
+    bool pinned;
+};
+
+// Place the calling worker thread of workers spread over the NUMA nodes:
+// worker k runs on node k % nodes. When pinned, the thread is bound to one
+// CPU of the node, so memory it touches first is allocated on that node.
+ThreadPlacement place_thread(size_t worker, bool pin) {
+    static const auto nodes = numa_nodes();
+    ThreadPlacement placement{worker, -1, -1, false};
+    if (pin && !nodes.empty()) {
+        const auto& cpus = nodes[worker % nodes.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[worker / nodes.size() % cpus.size()], &set);
+        placement.pinned = (::sched_setaffinity(0, sizeof(set), &set) == 0);
+    }
+    placement.cpu = ::sched_getcpu();
+    for (size_t node = 0; node < nodes.size(); ++node) {
+        if (std::count(nodes[node].begin(), nodes[node].end(), placement.cpu)) {
+            placement.node = node;
+        }
+    }
+    return placement;
+}
+
+// Tasks of a higher priority run first, in all the pool queues
+enum class TaskPriority : uint8_t { High, Normal, Low };
+
+// Work-stealing pool shared by the parallel paths. Each worker has its own
+// queue, takes its tasks newest first and steals the oldest tasks of the others.
+// Threads outside of the pool submit tasks to a common queue. A thread waiting
+// for a TaskGroup runs queued tasks meanwhile, so nested groups don't block
+// workers, and a pool of threads = 1 has no workers at all: the waiting caller
+// runs the top level tasks in the submission order, and nested ones newest first.
+// A wait nested in a task runs only the tasks of its group, so unrelated work,
+// like another plan, doesn't pile up on the stack of the waiting task.
+struct PoolOptions {
+    size_t threads = 0; // including the waiting caller, 0 for the hardware concurrency
+    bool pin = false; // pin the workers to CPUs spread over the NUMA nodes
+};
+
+class ThreadPool {
+public:
+    struct Stats {
+        std::string name;
+        size_t threads = 0;
+        uint64_t tasks = 0; // started
+        uint64_t steals = 0; // tasks taken from the queue of another worker
+        uint64_t busy = 0; // nanoseconds of running tasks, in all threads
+        uint64_t uptime = 0; // nanoseconds
+        std::vector<ThreadPlacement> placements; // of the workers, by worker
+
+        // share of the pool threads time spent in tasks
+        double utilization() const {
+            return uptime > 0 ? busy / (static_cast<double>(uptime) * threads) : 0;
+        }
+    };
+
+    using Task = std::function<void()>;
+
+    ThreadPool(const std::string& name, const PoolOptions& options)
+        : name(name)
+        , started(std::chrono::steady_clock::now())
     {
+        const size_t threads = (options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency()));
+        queues.resize(threads);
+        for (auto& queue : queues) {
+            queue = std::make_unique<Queue>();
+        }
+        for (size_t worker = 1; worker < threads; ++worker) {
+            workers.emplace_back([this, worker, pin = options.pin] {
+                current = this;
+                current_queue = worker;
+                const ThreadPlacement placement = place_thread(worker, pin);
+                {
+                    std::lock_guard lock(placements_mutex);
+                    placements.push_back(placement);
+                }
+                work();
+            });
+        }
+        std::lock_guard lock(registry_mutex);
+        registry.push_back(this);
     }
 
-    std::string chairs_str() const {
-        std::string str;
-        const char* delim = "";
-        for (size_t i = 0; i < chairs.size(); ++i) {
-            str += delim;
-            str += ChairTypes[i];
-            str += ": ";
-            str += std::to_string(chairs[i]);
-            delim = ", ";
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(registry_mutex);
+            registry.erase(std::find(registry.begin(), registry.end(), this));
+        }
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
         }
-        return str;
     }
 
-    // sort by name
-    bool operator<(const Room& other) const {
-        return this->name < other.name;
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // options of the shared pool, set before its first use
+    static inline PoolOptions shared_options;
+
+    // The pool of all the parallel paths, kept until the process exit
+    static ThreadPool& shared() {
+        static ThreadPool* pool = new ThreadPool("shared", shared_options);
+        return *pool;
     }
 
-    // for tests
-    bool operator==(const Room& other) const {
-        return this->name == other.name && this->pos == other.pos && this->chairs == other.chairs;
+    size_t size() const {
+        return queues.size();
     }
-    friend std::ostream& operator<<(std::ostream& os, const Room& room) {
-        return os << room.name << " at " << room.pos << ", chairs: " << room.chairs_str();
+
+    // Queue the task, group tags it for the waits nested in tasks
+    void submit(Task task, TaskPriority priority = TaskPriority::Normal, const void* group = nullptr) {
+        Queue& queue = *queues[current == this ? current_queue : 0];
+        {
+            std::lock_guard lock(queue.mutex);
+            queue.tasks[static_cast<size_t>(priority)].push_back(Entry{std::move(task), group});
+        }
+        ++queued;
+        ++submitted;
+        bool nested;
+        {
+            std::lock_guard lock(mutex);
+            nested = nested_waiters > 0;
+        }
+        if (nested) {
+            wakeup.notify_all(); // the nested waiter of the group may not be the one woken up
+        } else {
+            wakeup.notify_one();
+        }
+    }
+
+    // Run one queued task on the calling thread, returns false if there are none.
+    // Inside of a task, only a task of the group if it is given.
+    bool run_one(const void* group = nullptr) {
+        const size_t self = (current == this ? current_queue : 0);
+        const bool own = (group && task_depth > 0);
+        const auto matches = [&](const Entry& entry) { return !own || entry.group == group; };
+        Task task;
+        for (size_t priority = 0; !task && priority < std::tuple_size_v<decltype(Queue::tasks)>; ++priority) {
+            for (size_t i = 0; !task && i < queues.size(); ++i) {
+                const size_t index = (self + i) % queues.size();
+                std::lock_guard lock(queues[index]->mutex);
+                auto& tasks = queues[index]->tasks[priority];
+                if (index == self && (self != 0 || task_depth > 0)) {
+                    // own newest task first, nested waits take their own subtasks instead of new work
+                    const auto it = std::find_if(tasks.rbegin(), tasks.rend(), matches);
+                    if (it != tasks.rend()) {
+                        task = std::move(it->task);
+                        tasks.erase(std::next(it).base());
+                    }
+                } else {
+                    const auto it = std::find_if(tasks.begin(), tasks.end(), matches);
+                    if (it != tasks.end()) {
+                        task = std::move(it->task);
+                        tasks.erase(it);
+                        steals += (index != self);
+                    }
+                }
+            }
+        }
+        if (!task) {
+            return false;
+        }
+        --queued;
+        ++tasks;
+        const auto start = std::chrono::steady_clock::now();
+        ++task_depth;
+        try {
+            task();
+        } catch (...) {
+            --task_depth;
+            throw;
+        }
+        --task_depth;
+        busy += (std::chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+    // Run queued tasks, of the group when nested in a task, until done() or
+    // there are no tasks, and sleep until a task is queued or notify() is called
+    template<typename Done>
+    void help_until(Done&& done, const void* group = nullptr) {
+        while (!done()) {
+            const uint64_t seen = submitted;
+            if (run_one(group)) {
+                continue;
+            }
+            std::unique_lock lock(mutex);
+            if (group && task_depth > 0) {
+                // queued tasks of other groups don't wake up
+                ++nested_waiters;
+                wakeup.wait(lock, [&] { return submitted != seen || done(); });
+                --nested_waiters;
+            } else {
+                wakeup.wait(lock, [&] { return queued > 0 || done(); });
+            }
+        }
+    }
+
+    // wake up the threads waiting in help_until()
+    void notify() {
+        {
+            std::lock_guard lock(mutex);
+        }
+        wakeup.notify_all();
+    }
+
+    Stats stats() const {
+        Stats stats{name, queues.size(), tasks, steals, busy,
+            static_cast<uint64_t>((std::chrono::steady_clock::now() - started).count()), {}};
+        std::lock_guard lock(placements_mutex);
+        stats.placements = placements;
+        std::sort(stats.placements.begin(), stats.placements.end(),
+            [](const ThreadPlacement& a, const ThreadPlacement& b) { return a.worker < b.worker; });
+        return stats;
+    }
+
+    // statistics of the existing pools
+    static std::vector<Stats> all_stats() {
+        std::lock_guard lock(registry_mutex);
+        std::vector<Stats> stats;
+        for (const ThreadPool* pool : registry) {
+            stats.push_back(pool->stats());
+        }
+        return stats;
+    }
+private:
+    struct Entry {
+        Task task;
+        const void* group; // or nullptr
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::array<std::deque<Entry>, 3> tasks; // by priority
+    };
+
+    const std::string name;
+    const std::chrono::steady_clock::time_point started;
+    std::vector<std::unique_ptr<Queue>> queues; // of the workers, queues[0] is for the threads outside of the pool
+    std::vector<std::thread> workers;
+    std::mutex mutex; // of sleeping and waking up
+    std::condition_variable wakeup;
+    std::atomic<size_t> queued{0};
+    std::atomic<uint64_t> submitted{0};
+    size_t nested_waiters = 0; // in help_until() of a group inside of a task
+    bool stopping = false;
+    std::atomic<uint64_t> tasks{0};
+    std::atomic<uint64_t> steals{0};
+    std::atomic<uint64_t> busy{0};
+    mutable std::mutex placements_mutex;
+    std::vector<ThreadPlacement> placements; // of the started workers
+
+    static thread_local inline ThreadPool* current = nullptr; // pool of the worker thread
+    static thread_local inline size_t current_queue = 0;
+    static thread_local inline size_t task_depth = 0; // tasks running on the thread, nested in waits
+    static inline std::mutex registry_mutex;
+    static inline std::vector<ThreadPool*> registry;
+
+    void work() {
+        for (;;) {
+            if (run_one()) {
+                continue;
+            }
+            std::unique_lock lock(mutex);
+            wakeup.wait(lock, [this] { return queued > 0 || stopping; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
     }
 };
-using Rooms = std::vector<Room>;
 
-std::ostream& operator<<(std::ostream& os, const Rooms& rooms) {
-    for (const auto& room : rooms) {
-        os << room << '\n';
+// Fork-join group of pool tasks. wait() runs queued tasks until the tasks of
+// the group are done and rethrows the first exception of them.
+class TaskGroup {
+private:
+    ThreadPool& pool;
+    std::atomic<size_t> pending{0};
+    std::mutex mutex;
+    std::exception_ptr error;
+public:
+    explicit TaskGroup(ThreadPool& pool = ThreadPool::shared())
+        : pool(pool)
+    {
+    }
+
+    ~TaskGroup() {
+        pool.help_until([this] { return pending == 0; }, this);
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    void run(ThreadPool::Task task, TaskPriority priority = TaskPriority::Normal) {
+        ++pending;
+        pool.submit([this, task = std::move(task)] {
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            ThreadPool& pool = this->pool;
+            if (--pending == 0) {
+                pool.notify(); // the group may be destroyed by now
+            }
+        }, priority, this);
+    }
+
+    void wait() {
+        pool.help_until([this] { return pending == 0; }, this);
+        std::lock_guard lock(mutex);
+        if (error) {
+            const auto rethrown = error;
+            error = nullptr;
+            std::rethrow_exception(rethrown);
+        }
+    }
+};
+
+void print_stats(std::ostream& os) {
+    os << "stats:\n";
+    for (size_t i = 0; i < PhaseNames.size(); ++i) {
+        os << PhaseNames[i] << ": " << PhaseScope::nanoseconds(static_cast<Phase>(i)) / 1000 / 1000.0 << " ms";
+#if defined(CHAIRS_ALLOC_STATS)
+        const auto& stats = phase_stats[i];
+        os << ", allocations: " << stats.allocations << ", bytes: " << stats.bytes << ", peak: " << stats.peak;
+#endif
+        os << '\n';
+    }
+#if !defined(CHAIRS_ALLOC_STATS)
+    os << "allocations: not tracked, build with -DCHAIRS_ALLOC_STATS\n";
+#endif
+    for (const auto& pool : ThreadPool::all_stats()) {
+        os << "pool " << pool.name << ": threads " << pool.threads << ", tasks " << pool.tasks << ", steals " << pool.steals
+           << ", utilization " << pool.utilization() * 100 << "%\n";
+        for (const auto& placement : pool.placements) {
+            os << "worker " << placement.worker << ": cpu " << placement.cpu << ", node " << placement.node
+               << (placement.pinned ? ", pinned" : "") << '\n';
+        }
     }
-    return os;
 }
 
-class Plan {
+// Prometheus histogram buckets in seconds
+constexpr auto HistogramBuckets = std::array{ 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3, 1e-2, 5e-2, 0.1, 0.5, 1.0, 5.0 };
+
+// Metrics of a thread. A shard is written only by its own thread with relaxed
+// load and store, without locked instructions, and summed by the scraper.
+struct MetricsShard {
+    struct Histogram {
+        std::array<std::atomic<uint64_t>, HistogramBuckets.size() + 1> buckets{}; // the last one is +Inf
+        std::atomic<uint64_t> sum{0}; // nanoseconds
+
+        void observe(uint64_t nanoseconds) {
+            const auto bucket = std::lower_bound(HistogramBuckets.begin(), HistogramBuckets.end(), nanoseconds / 1e9);
+            add(buckets[bucket - HistogramBuckets.begin()], 1);
+            add(sum, nanoseconds);
+        }
+
+        void merge(const Histogram& other) {
+            for (size_t i = 0; i < buckets.size(); ++i) {
+                add(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+            }
+            add(sum, other.sum.load(std::memory_order_relaxed));
+        }
+    };
+
+    std::atomic<uint64_t> plans{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> cells{0};
+    std::atomic<int64_t> in_flight{0}; // gauge, a request is added and then subtracted
+    std::array<Histogram, PhaseNames.size()> phases;
+
+    static void add(std::atomic<uint64_t>& value, uint64_t delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    static void add(std::atomic<int64_t>& value, int64_t delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    void merge(const MetricsShard& other) {
+        add(plans, other.plans.load(std::memory_order_relaxed));
+        add(errors, other.errors.load(std::memory_order_relaxed));
+        add(cells, other.cells.load(std::memory_order_relaxed));
+        add(in_flight, other.in_flight.load(std::memory_order_relaxed));
+        for (size_t i = 0; i < phases.size(); ++i) {
+            phases[i].merge(other.phases[i]);
+        }
+    }
+};
+
+// Registry of the thread metric shards
+class Metrics {
 private:
-    std::vector<std::string> plan;
+    std::mutex mutex;
+    std::vector<MetricsShard*> shards;
+    MetricsShard retired; // merged shards of finished threads
+
+    // Registers the shard of a thread, merges it into retired on the thread exit
+    struct Local {
+        MetricsShard shard;
+        Local() {
+            std::lock_guard lock(instance().mutex);
+            instance().shards.push_back(&shard);
+        }
+        ~Local() {
+            Metrics& metrics = instance();
+            std::lock_guard lock(metrics.mutex);
+            metrics.retired.merge(shard);
+            metrics.shards.erase(std::find(metrics.shards.begin(), metrics.shards.end(), &shard));
+        }
+    };
+
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
 public:
-    void read(std::istream& input) {
-        plan.clear();
-        for (std::string line; std::getline(input, line); line.clear()) {
-            plan.push_back(std::move(line));
+    // shard of the calling thread
+    static MetricsShard& local() {
+        thread_local Local local;
+        return local.shard;
+    }
+
+    // Prometheus text exposition format
+    static std::string exposition() {
+        MetricsShard total;
+        {
+            Metrics& metrics = instance();
+            std::lock_guard lock(metrics.mutex);
+            total.merge(metrics.retired);
+            for (const MetricsShard* shard : metrics.shards) {
+                total.merge(*shard);
+            }
+        }
+        std::ostringstream out;
+        const auto metric = [&out](const char* name, const char* type, const char* help, const auto& value) {
+            out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n' << name << ' ' << value << '\n';
+        };
+        metric("chairs_plans_processed_total", "counter", "Plans processed.", total.plans);
+        metric("chairs_plan_errors_total", "counter", "Plans failed to process.", total.errors);
+        metric("chairs_cells_processed_total", "counter", "Plan cells visited by the flood fill.", total.cells);
+        metric("chairs_requests_in_flight", "gauge", "Requests queued or being processed.", total.in_flight);
+
+        const char* name = "chairs_phase_duration_seconds";
+        out << "# HELP " << name << " Plan processing phase duration.\n# TYPE " << name << " histogram\n";
+        for (size_t phase = 1; phase < PhaseNames.size(); ++phase) {
+            const auto& histogram = total.phases[phase];
+            uint64_t count = 0;
+            for (size_t i = 0; i < histogram.buckets.size(); ++i) {
+                count += histogram.buckets[i];
+                out << name << "_bucket{phase=\"" << PhaseNames[phase] << "\",le=\"";
+                if (i < HistogramBuckets.size()) {
+                    out << HistogramBuckets[i];
+                } else {
+                    out << "+Inf";
+                }
+                out << "\"} " << count << '\n';
+            }
+            out << name << "_sum{phase=\"" << PhaseNames[phase] << "\"} " << histogram.sum / 1e9 << '\n';
+            out << name << "_count{phase=\"" << PhaseNames[phase] << "\"} " << count << '\n';
+        }
+
+        const auto pools = ThreadPool::all_stats();
+        const auto pool_metric = [&](const char* name, const char* type, const char* help, auto value) {
+            out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+            for (const auto& pool : pools) {
+                out << name << "{pool=\"" << pool.name << "\"} " << value(pool) << '\n';
+            }
+        };
+        pool_metric("chairs_pool_threads", "gauge", "Pool threads with the waiting caller.",
+            [](const ThreadPool::Stats& pool) { return pool.threads; });
+        pool_metric("chairs_pool_tasks_total", "counter", "Pool tasks started.",
+            [](const ThreadPool::Stats& pool) { return pool.tasks; });
+        pool_metric("chairs_pool_steals_total", "counter", "Pool tasks stolen from the queue of another worker.",
+            [](const ThreadPool::Stats& pool) { return pool.steals; });
+        pool_metric("chairs_pool_busy_seconds_total", "counter", "Time the pool threads spent in tasks.",
+            [](const ThreadPool::Stats& pool) { return pool.busy / 1e9; });
+
+        long pages = 0;
+        std::ifstream("/proc/self/statm") >> pages >> pages;
+        metric("process_resident_memory_bytes", "gauge", "Resident memory size in bytes.", pages * ::sysconf(_SC_PAGESIZE));
+        return out.str();
+    }
+};
+
+// Unicode box-drawing characters U+2500..U+257F are encoded in UTF-8 as
+// E2 94 80..E2 95 BF, this table maps them to the single-byte wall cells
+constexpr auto BoxDrawing = [] {
+    std::array<char, 128> table{};
+    const auto fill = [&table](unsigned first, unsigned last, char c) {
+        for (unsigned i = first; i <= last; ++i) {
+            table[i - 0x2500] = c;
         }
+    };
+    fill(0x2500, 0x257F, '+'); // corners, tees, crosses, arcs
+    fill(0x2500, 0x2501, '-'); fill(0x2504, 0x2505, '-'); fill(0x2508, 0x2509, '-');
+    fill(0x254C, 0x254D, '-'); fill(0x2550, 0x2550, '-');
+    fill(0x2502, 0x2503, '|'); fill(0x2506, 0x2507, '|'); fill(0x250A, 0x250B, '|');
+    fill(0x254E, 0x254F, '|'); fill(0x2551, 0x2551, '|');
+    for (unsigned c = 0x2574; c <= 0x257F; ++c) {
+        table[c - 0x2500] = (c % 2 == 0 ? '-' : '|'); // half lines
     }
+    fill(0x2571, 0x2571, '/');
+    fill(0x2572, 0x2572, '\\');
+    return table;
+}();
 
-    std::vector<Room> find_chairs_in_rooms() {
-        std::vector<Room> rooms;
+// Returns offset of the first non-ASCII byte in [begin, begin + size), or size
+size_t find_non_ascii(const char* begin, size_t size) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= size; i += 16) {
+        const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + i));
+        if (const int mask = _mm_movemask_epi8(chunk)) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, begin + i, sizeof(word));
+        if (word & 0x8080808080808080ull) {
+            break;
+        }
+    }
+    for (; i < size; ++i) {
+        if (begin[i] & 0x80) {
+            break;
+        }
+    }
+    return i;
+}
+
+// Append offset + i + 1 to starts for each newline at begin[i], the line starts after it
+void find_newlines(const char* begin, size_t size, uint64_t offset, std::vector<uint64_t>& starts) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const auto newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16) {
+        const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + i));
+        for (int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)); mask; mask &= mask - 1) {
+            starts.push_back(offset + i + __builtin_ctz(mask) + 1);
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        if (begin[i] == '\n') {
+            starts.push_back(offset + i + 1);
+        }
+    }
+}
+
+// Transcode UTF-8 box-drawing characters in the line to ASCII walls `+-|/\`
+// in one pass, other bytes are kept as is
+void transcode(std::string& line) {
+    size_t read = find_non_ascii(line.data(), line.size());
+    size_t write = read;
+    while (read < line.size()) {
+        const auto byte = [&line](size_t i) { return i < line.size() ? static_cast<uint8_t>(line[i]) : 0; };
+        if (byte(read) == 0xE2 && (byte(read + 1) == 0x94 || byte(read + 1) == 0x95) && (byte(read + 2) & 0xC0) == 0x80) {
+            line[write++] = BoxDrawing[(byte(read + 1) - 0x94) * 64 + (byte(read + 2) & 0x3F)];
+            read += 3;
+        } else {
+            line[write++] = line[read++];
+        }
+        const size_t ascii = find_non_ascii(line.data() + read, line.size() - read);
+        std::memmove(line.data() + write, line.data() + read, ascii);
+        read += ascii;
+        write += ascii;
+    }
+    line.resize(write);
+}
+
+// Gzip data starts with 0x1F, which is never in a plan text
+bool is_gzip(std::istream& in) {
+    return in.peek() == 0x1F;
+}
+
+#if defined(CHAIRS_WITH_ZLIB)
+// Stream buffer of inflated gzip source data, concatenated gzip members are inflated one after another
+class GzipStreambuf : public std::streambuf {
+private:
+    std::istream& source;
+    z_stream stream{};
+    bool member_end = false;
+    std::array<char, 64 * 1024> input;
+    std::array<char, 64 * 1024> output;
+protected:
+    int_type underflow() override {
+        while (gptr() == egptr()) {
+            if (stream.avail_in == 0) {
+                source.read(input.data(), input.size());
+                stream.next_in = reinterpret_cast<Bytef*>(input.data());
+                stream.avail_in = source.gcount();
+                if (stream.avail_in == 0) {
+                    if (!member_end) {
+                        throw std::runtime_error("Truncated gzip data");
+                    }
+                    return traits_type::eof();
+                }
+            }
+            if (member_end) {
+                // another member starts with the gzip magic 1F 8B
+                if (stream.next_in[0] != 0x1F || (stream.avail_in > 1 && stream.next_in[1] != 0x8B)) {
+                    throw std::runtime_error("Trailing data after gzip data");
+                }
+                ::inflateReset(&stream);
+                member_end = false;
+            }
+            stream.next_out = reinterpret_cast<Bytef*>(output.data());
+            stream.avail_out = output.size();
+            const int ret = ::inflate(&stream, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                member_end = true;
+            } else if (ret != Z_OK) {
+                throw std::runtime_error(std::string("Invalid gzip data: ") + (stream.msg ? stream.msg : std::to_string(ret)));
+            }
+            setg(output.data(), output.data(), output.data() + output.size() - stream.avail_out);
+        }
+        return traits_type::to_int_type(*gptr());
+    }
+public:
+    explicit GzipStreambuf(std::istream& source)
+        : source(source)
+    {
+        if (::inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+            throw std::runtime_error("Can't initialize gzip decompression");
+        }
+    }
+
+    ~GzipStreambuf() {
+        ::inflateEnd(&stream);
+    }
+};
+#endif
+
+// Input stream of decompressed gzip source, available when built with -DCHAIRS_WITH_ZLIB and zlib.
+// Decompression errors are thrown from the stream reading functions
+class GzipIstream : public std::istream {
+#if defined(CHAIRS_WITH_ZLIB)
+private:
+    GzipStreambuf buf;
+public:
+    explicit GzipIstream(std::istream& source)
+        : std::istream(nullptr)
+        , buf(source)
+    {
+        rdbuf(&buf);
+        exceptions(std::ios::badbit);
+    }
+#else
+public:
+    explicit GzipIstream(std::istream&)
+        : std::istream(nullptr)
+    {
+        throw std::runtime_error("Gzip input is not supported, build with -DCHAIRS_WITH_ZLIB -lz");
+    }
+#endif
+};
+
+struct Pos {
+    ssize_t x = 0;
+    ssize_t y = 0;
+    std::string str() const {
+        return "(" + std::to_string(x) + ", " + std::to_string(y) + ")";
+    }
+
+    // row-major order
+    bool operator<(const Pos& other) const {
+        return std::tie(this->y, this->x) < std::tie(other.y, other.x);
+    }
+
+    // for tests
+    bool operator==(const Pos& other) const {
+        return this->x == other.x && this->y == other.y;
+    }
+    friend std::ostream& operator<<(std::ostream& os, const Pos& pos) {
+        return os << "(" << pos.x << ", " << pos.y << ")";
+    }
+};
+
+using ChairCount = std::array<size_t, std::size(ChairTypes)>;
+
+// Plan dialect policies: flood fill neighborhood, wall and door cells, and
+// chair cells in the ChairTypes order. The fill is instantiated once per dialect.
+struct Classic {
+    static constexpr auto name = "classic";
+    static constexpr auto neighbors = std::array{ Pos{0, 1}, Pos{0, -1}, Pos{1, 0}, Pos{-1, 0} };
+    static constexpr auto walls = WallTypes;
+    static constexpr auto doors = DoorTypes;
+    static constexpr auto chairs = ChairTypes;
+};
+
+// 8-connected, a diagonal step squeezing between two wall cells is blocked,
+// so diagonal walls and walls without `+` corners stay closed
+struct Diagonal : Classic {
+    static constexpr auto name = "diagonal";
+    static constexpr auto neighbors = std::array{ Pos{0, 1}, Pos{0, -1}, Pos{1, 0}, Pos{-1, 0},
+        Pos{1, 1}, Pos{1, -1}, Pos{-1, 1}, Pos{-1, -1} };
+};
+
+// `/` and `\` are floor hatching, not walls
+struct Hatched : Classic {
+    static constexpr auto name = "hatched";
+    static constexpr auto walls = std::array{ '+', '-', '|', '\n' };
+};
+
+using Dialects = std::tuple<Classic, Diagonal, Hatched>;
+
+// Cell classes, chair types are non-negative
+enum : int8_t { OpenCell = -1, WallCell = -2, VisitedCell = -3, DoorCell = -4 };
+
+template<typename Dialect>
+constexpr auto CellClasses = [] {
+    static_assert(std::size(Dialect::chairs) == std::size(ChairTypes), "Dialect must define all chair types");
+    std::array<int8_t, 256> classes{};
+    for (auto& cls : classes) {
+        cls = OpenCell;
+    }
+    for (char c : Dialect::walls) {
+        classes[static_cast<uint8_t>(c)] = WallCell;
+    }
+    for (char c : Dialect::doors) {
+        classes[static_cast<uint8_t>(c)] = DoorCell;
+    }
+    for (size_t i = 0; i < std::size(Dialect::chairs); ++i) {
+        classes[static_cast<uint8_t>(Dialect::chairs[i])] = static_cast<int8_t>(i);
+    }
+    classes[static_cast<uint8_t>(Visited)] = VisitedCell;
+    return classes;
+}();
+
+template<typename Dialect>
+constexpr int8_t cell_class(char c) {
+    return CellClasses<Dialect>[static_cast<uint8_t>(c)];
+}
+
+// Call func with the dialect instance named `name`
+template<typename Func>
+void with_dialect(const std::string& name, Func&& func) {
+    const bool found = std::apply([&](auto... dialects) {
+        return ((name == dialects.name ? (func(dialects), true) : false) || ...);
+    }, Dialects{});
+    if (!found) {
+        throw std::runtime_error("Unknown plan dialect " + name);
+    }
+}
+
+struct Room {
+    std::string name;
+    Pos pos;
+    ChairCount chairs{};
+
+    Room(const std::string& name, const Pos& pos = {}, const ChairCount& chairs = {})
+        : name(name), pos(pos), chairs(chairs)
+    {
+    }
+
+    std::string chairs_str() const {
+        std::string str;
+        const char* delim = "";
+        for (size_t i = 0; i < chairs.size(); ++i) {
+            str += delim;
+            str += ChairTypes[i];
+            str += ": ";
+            str += std::to_string(chairs[i]);
+            delim = ", ";
+        }
+        return str;
+    }
+
+    // sort by name
+    bool operator<(const Room& other) const {
+        return this->name < other.name;
+    }
+
+    // for tests
+    bool operator==(const Room& other) const {
+        return this->name == other.name && this->pos == other.pos && this->chairs == other.chairs;
+    }
+    friend std::ostream& operator<<(std::ostream& os, const Room& room) {
+        return os << room.name << " at " << room.pos << ", chairs: " << room.chairs_str();
+    }
+};
+using Rooms = std::vector<Room>;
+
+std::ostream& operator<<(std::ostream& os, const Rooms& rooms) {
+    for (const auto& room : rooms) {
+        os << room << '\n';
+    }
+    return os;
+}
+
+// Stable MSD radix sort of string keys, in the same byte-wise order as std::string operator<.
+// Ranges up to RadixSortCutoff keys fall back to comparison sort.
+constexpr size_t RadixSortCutoff = 64;
+
+// Distribute order by the key byte at depth, bucket 0 is for keys ending before depth.
+// Returns bucket bounds in order
+std::array<size_t, 258> radix_partition(const std::vector<std::string_view>& keys, size_t* order, size_t* buffer, size_t count, size_t depth) {
+    const auto bucket = [&keys, depth](size_t index) {
+        const std::string_view key = keys[index];
+        return key.size() > depth ? 1 + static_cast<unsigned char>(key[depth]) : 0;
+    };
+    std::array<size_t, 258> bounds{};
+    for (size_t i = 0; i < count; ++i) {
+        ++bounds[bucket(order[i]) + 1];
+    }
+    for (size_t b = 1; b < bounds.size(); ++b) {
+        bounds[b] += bounds[b - 1];
+    }
+    std::array<size_t, 258> next = bounds;
+    for (size_t i = 0; i < count; ++i) {
+        buffer[next[bucket(order[i])]++] = order[i];
+    }
+    std::copy_n(buffer, count, order);
+    return bounds;
+}
+
+void radix_sort_keys(const std::vector<std::string_view>& keys, size_t* order, size_t* buffer, size_t count, size_t depth) {
+    if (count <= RadixSortCutoff) {
+        std::stable_sort(order, order + count, [&keys, depth](size_t a, size_t b) {
+            return keys[a].substr(depth) < keys[b].substr(depth);
+        });
+        return;
+    }
+    const auto bounds = radix_partition(keys, order, buffer, count, depth);
+    for (size_t b = 1; b + 1 < bounds.size(); ++b) {
+        if (bounds[b + 1] - bounds[b] > 1) {
+            radix_sort_keys(keys, order + bounds[b], buffer + bounds[b], bounds[b + 1] - bounds[b], depth + 1);
+        }
+    }
+}
+
+// Sort items by key(item) string, buckets of the first byte are sorted
+// in parallel by the shared pool for at least parallel_threshold items
+template<typename T, typename Key>
+void radix_sort(std::vector<T>& items, Key key, size_t parallel_threshold = 1 << 16) {
+    if (items.size() <= RadixSortCutoff) {
+        std::stable_sort(items.begin(), items.end(), [&key](const T& a, const T& b) { return key(a) < key(b); });
+        return;
+    }
+    std::vector<std::string_view> keys;
+    keys.reserve(items.size());
+    for (const T& item : items) {
+        keys.push_back(key(item));
+    }
+    std::vector<size_t> order(items.size()), buffer(items.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    if (items.size() < parallel_threshold) {
+        radix_sort_keys(keys, order.data(), buffer.data(), order.size(), 0);
+    } else {
+        const auto bounds = radix_partition(keys, order.data(), buffer.data(), order.size(), 0);
+        // high priority to finish the started sort before the other queued work
+        TaskGroup group;
+        for (size_t b = 1; b + 1 < bounds.size(); ++b) {
+            if (bounds[b + 1] - bounds[b] > 1) {
+                group.run([&, b] {
+                    radix_sort_keys(keys, order.data() + bounds[b], buffer.data() + bounds[b], bounds[b + 1] - bounds[b], 1);
+                }, TaskPriority::High);
+            }
+        }
+        group.wait();
+    }
+    std::vector<T> sorted;
+    sorted.reserve(items.size());
+    for (size_t index : order) {
+        sorted.push_back(std::move(items[index]));
+    }
+    items.swap(sorted);
+}
+
+// Door cell is walkable, but separates rooms
+struct Door {
+    Pos pos;
+    std::vector<std::string> rooms; // connected rooms sorted by name
+
+    std::string rooms_str() const {
+        std::string str;
+        const char* delim = "";
+        for (const auto& room : rooms) {
+            str += delim;
+            str += room;
+            delim = " - ";
+        }
+        return str;
+    }
+
+    // for tests
+    bool operator==(const Door& other) const {
+        return this->pos == other.pos && this->rooms == other.rooms;
+    }
+    friend std::ostream& operator<<(std::ostream& os, const Door& door) {
+        return os << door.rooms_str() << " at " << door.pos;
+    }
+};
+using Doors = std::vector<Door>;
+
+std::ostream& operator<<(std::ostream& os, const Doors& doors) {
+    for (const auto& door : doors) {
+        os << door << '\n';
+    }
+    return os;
+}
+
+// Dense grid stores every plan line as is
+class DenseGrid {
+private:
+    std::vector<std::string> lines;
+public:
+    static constexpr auto name = "dense";
+    static constexpr bool tiled = false;
+    using Queue = std::queue<Pos>; // of cells to visit by QueueFill
+
+    void clear() {
+        lines.clear();
+    }
+
+    void push_line(std::string&& line) {
+        lines.push_back(std::move(line));
+    }
+
+    void finish() {
+    }
+
+    size_t height() const {
+        return lines.size();
+    }
+
+    size_t width() const {
+        size_t width = 0;
+        for (const auto& line : lines) {
+            width = std::max(width, line.size());
+        }
+        return width;
+    }
+
+    // cell at pos, or '\n' wall outside of the plan
+    char get(const Pos& pos) const {
+        if (0 <= pos.y && pos.y < static_cast<ssize_t>(lines.size()) && 0 <= pos.x && pos.x < static_cast<ssize_t>(lines[pos.y].size())) {
+            return lines[pos.y][pos.x];
+        }
+        return '\n';
+    }
+
+    void set(const Pos& pos, char c) {
+        lines[pos.y][pos.x] = c;
+    }
+};
+
+// Sparse grid stores only non-empty tiles of the plan. Tiles of spaces are
+// stored as an "all open" marker, tiles beyond the line ends as an "all outside"
+// marker, so memory scales with the built area instead of the canvas.
+class SparseGrid {
+public:
+    static constexpr auto name = "sparse";
+    static constexpr bool tiled = true;
+    using Queue = std::queue<Pos>; // of cells to visit by QueueFill
+    static constexpr ssize_t TileWidth = 64;
+    static constexpr ssize_t TileHeight = 16;
+private:
+    enum : uint32_t { OutsideTile = UINT32_MAX, OpenTile = OutsideTile - 1, VisitedTile = OutsideTile - 2 };
+    using Tile = std::array<char, TileWidth * TileHeight>;
+
+    std::vector<std::vector<uint32_t>> directory; // tile rows of tile indices or empty tile markers
+    std::vector<Tile> tiles;
+    std::vector<std::string> band; // lines of the incomplete tile row
+    size_t lines = 0;
+public:
+    void clear() {
+        directory.clear();
+        tiles.clear();
+        band.clear();
+        lines = 0;
+    }
+
+    void push_line(std::string&& line) {
+        band.push_back(std::move(line));
+        ++lines;
+        if (band.size() == TileHeight) {
+            flush_band();
+        }
+    }
+
+    void finish() {
+        if (!band.empty()) {
+            flush_band();
+        }
+    }
+
+    size_t height() const {
+        return lines;
+    }
+
+    size_t stored_tiles() const {
+        return tiles.size();
+    }
+
+    // cell at pos, or '\n' wall outside of the plan
+    char get(const Pos& pos) const {
+        if (pos.x < 0 || pos.y < 0 || pos.y >= static_cast<ssize_t>(lines)) {
+            return '\n';
+        }
+        const auto& row = directory[pos.y / TileHeight];
+        const size_t tx = pos.x / TileWidth;
+        if (tx >= row.size()) {
+            return '\n';
+        }
+        switch (row[tx]) {
+        case OutsideTile: return '\n';
+        case OpenTile: return ' ';
+        case VisitedTile: return Visited;
+        default: return tiles[row[tx]][(pos.y % TileHeight) * TileWidth + pos.x % TileWidth];
+        }
+    }
+
+    // set a cell of a stored tile
+    void set(const Pos& pos, char c) {
+        tiles[directory[pos.y / TileHeight][pos.x / TileWidth]][(pos.y % TileHeight) * TileWidth + pos.x % TileWidth] = c;
+    }
+
+    // If pos is in an open tile, mark the whole tile visited and return its corner cells
+    bool visit_open_tile(const Pos& pos, Pos& first, Pos& last) {
+        auto& tile = directory[pos.y / TileHeight][pos.x / TileWidth];
+        if (tile != OpenTile) {
+            return false;
+        }
+        tile = VisitedTile;
+        first = Pos{pos.x / TileWidth * TileWidth, pos.y / TileHeight * TileHeight};
+        last = Pos{first.x + TileWidth - 1, std::min(first.y + TileHeight, static_cast<ssize_t>(lines)) - 1};
+        return true;
+    }
+private:
+    void flush_band() {
+        size_t width = 0;
+        for (const auto& line : band) {
+            width = std::max(width, line.size());
+        }
+        auto& row = directory.emplace_back((width + TileWidth - 1) / TileWidth, OutsideTile);
+        for (size_t tx = 0; tx < row.size(); ++tx) {
+            const size_t x = tx * TileWidth;
+            bool outside = true, open = true;
+            for (const auto& line : band) {
+                const size_t len = std::min<size_t>(TileWidth, line.size() > x ? line.size() - x : 0);
+                outside = outside && len == 0;
+                open = open && len == TileWidth && std::all_of(line.begin() + x, line.begin() + x + len, [](char c) { return c == ' '; });
+            }
+            if (outside || open) {
+                row[tx] = (outside ? OutsideTile : OpenTile);
+                continue;
+            }
+            row[tx] = static_cast<uint32_t>(tiles.size());
+            Tile& tile = tiles.emplace_back();
+            tile.fill('\n');
+            for (size_t y = 0; y < band.size(); ++y) {
+                if (band[y].size() > x) {
+                    band[y].copy(tile.data() + y * TileWidth, TileWidth, x);
+                }
+            }
+        }
+        while (!row.empty() && row.back() == OutsideTile) {
+            row.pop_back();
+        }
+        band.clear();
+    }
+};
+
+// Queue in a fixed-size array for constant evaluation, popped slots aren't reused
+template<typename T, size_t Capacity>
+class FixedQueue {
+private:
+    std::array<T, Capacity> values{};
+    size_t head = 0;
+    size_t tail = 0;
+public:
+    constexpr bool empty() const {
+        return head == tail;
+    }
+
+    constexpr const T& front() const {
+        return values[head];
+    }
+
+    constexpr void push(const T& value) {
+        if (tail == Capacity) {
+            throw std::runtime_error("Fixed queue is full");
+        }
+        values[tail++] = value;
+    }
+
+    constexpr void pop() {
+        ++head;
+    }
+};
+
+// Grid of a plan of at most Size characters in fixed-size arrays, for plans analyzed at compile
+// time by static_plan(). Visited cells are labeled with the label of the room being filled.
+template<size_t Size>
+class StaticGrid {
+public:
+    static constexpr auto name = "static";
+    static constexpr bool tiled = false;
+    // a cell is pushed by each of its at most 8 neighbors when they are visited
+    using Queue = FixedQueue<Pos, 8 * Size + 1>;
+
+    std::array<char, Size> chars{};
+    std::array<uint16_t, Size> labels{}; // of each plan character, 0 if not in a room
+    std::array<uint32_t, Size + 1> line_starts{};
+    size_t lines = 0;
+    uint16_t label = 0; // of the visited cells
+
+    constexpr explicit StaticGrid(std::string_view plan) {
+        if (plan.size() > Size) {
+            throw std::runtime_error("Plan is larger than the static plan size");
+        }
+        for (size_t i = 0; i < plan.size(); ++i) {
+            chars[i] = plan[i];
+        }
+        // line_starts[y + 1] is after the line end, as if the last line ends with a new line
+        for (size_t i = 0; i <= plan.size(); ++i) {
+            if (i == plan.size() || plan[i] == '\n') {
+                line_starts[++lines] = i + 1;
+            }
+        }
+    }
+
+    // offset of pos in the plan, or -1 outside of the plan lines
+    constexpr ssize_t offset(const Pos& pos) const {
+        if (0 <= pos.y && pos.y < static_cast<ssize_t>(lines) && 0 <= pos.x
+                && pos.x < static_cast<ssize_t>(line_starts[pos.y + 1] - line_starts[pos.y] - 1)) {
+            return line_starts[pos.y] + pos.x;
+        }
+        return -1;
+    }
+
+    constexpr std::string_view line(size_t y) const {
+        return std::string_view(chars.data() + line_starts[y], line_starts[y + 1] - line_starts[y] - 1);
+    }
+
+    // cell at pos, or '\n' wall outside of the plan
+    constexpr char get(const Pos& pos) const {
+        const ssize_t offset = this->offset(pos);
+        return offset >= 0 ? chars[offset] : '\n';
+    }
+
+    constexpr void set(const Pos& pos, char c) {
+        const ssize_t offset = this->offset(pos);
+        chars[offset] = c;
+        if (c == Visited) {
+            labels[offset] = label;
+        }
+    }
+};
+
+void write_varint(std::ostream& out, uint64_t value) {
+    for (; value >= 0x80; value >>= 7) {
+        out.put(static_cast<char>(value | 0x80));
+    }
+    out.put(static_cast<char>(value));
+}
+
+// Returns false at the end of input, throws on a truncated value
+bool read_varint(std::istream& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        const int byte = in.get();
+        if (byte == std::char_traits<char>::eof()) {
+            if (shift == 0) {
+                return false;
+            }
+            break;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    throw std::runtime_error("Truncated varint");
+}
+
+// Compact plan format is a magic line and varint length prefixed rows.
+// A row is encoded by runs of bytes copied from the previous row at the same offset,
+// runs of a repeated byte and literal bytes, each run starts with varint length << 2 | run kind
+constexpr std::string_view CompactPlanMagic = "\x1E" "CHAIRPLAN1\n";
+
+enum CompactRun { CopyRun = 0, RepeatRun = 1, LiteralRun = 2 };
+
+// Widest compact plan row, a longer row size is corrupt data
+constexpr uint64_t MaxCompactRowSize = 64 << 20;
+
+// Compact plan starts with 0x1E, which is never in a plan text
+bool is_compact_plan(std::istream& in) {
+    return in.peek() == CompactPlanMagic[0];
+}
+
+class CompactPlanWriter {
+private:
+    static constexpr size_t MinRun = 3; // shorter runs are literal
+
+    std::ostream& out;
+    std::string previous;
+
+    void write_run(CompactRun kind, size_t length) {
+        write_varint(out, length << 2 | kind);
+    }
+public:
+    explicit CompactPlanWriter(std::ostream& out)
+        : out(out)
+    {
+        out << CompactPlanMagic;
+    }
+
+    void write_line(const std::string& line) {
+        write_varint(out, line.size());
+        size_t literal = 0; // start of pending literal bytes
+        const auto flush_literal = [&](size_t end) {
+            if (end > literal) {
+                write_run(LiteralRun, end - literal);
+                out.write(line.data() + literal, end - literal);
+            }
+        };
+        for (size_t i = 0; i < line.size();) {
+            size_t copy = 0, repeat = 1;
+            while (i + copy < std::min(line.size(), previous.size()) && line[i + copy] == previous[i + copy]) {
+                ++copy;
+            }
+            while (i + repeat < line.size() && line[i + repeat] == line[i]) {
+                ++repeat;
+            }
+            if (std::max(copy, repeat) < MinRun) {
+                ++i;
+                continue;
+            }
+            flush_literal(i);
+            if (copy >= repeat) {
+                write_run(CopyRun, copy);
+                i += copy;
+            } else {
+                write_run(RepeatRun, repeat);
+                out.put(line[i]);
+                i += repeat;
+            }
+            literal = i;
+        }
+        flush_literal(line.size());
+        previous = line;
+    }
+};
+
+class CompactPlanReader {
+private:
+    std::istream& in;
+    std::string previous;
+public:
+    explicit CompactPlanReader(std::istream& in)
+        : in(in)
+    {
+        std::string magic(CompactPlanMagic.size(), '\0');
+        if (!in.read(magic.data(), magic.size()) || magic != CompactPlanMagic) {
+            throw std::runtime_error("Invalid compact plan");
+        }
+    }
+
+    // Returns false at the end of input
+    bool next_line(std::string& line) {
+        uint64_t size;
+        if (!read_varint(in, size)) {
+            return false;
+        } else if (size > MaxCompactRowSize) {
+            throw std::runtime_error("Invalid compact plan");
+        }
+        line.resize(size);
+        for (size_t pos = 0; pos < size;) {
+            uint64_t run;
+            if (!read_varint(in, run)) {
+                throw std::runtime_error("Truncated compact plan");
+            }
+            const size_t length = run >> 2;
+            if (length == 0 || length > size - pos) {
+                throw std::runtime_error("Invalid compact plan run");
+            }
+            switch (run & 3) {
+            case CopyRun:
+                if (pos + length > previous.size()) {
+                    throw std::runtime_error("Invalid compact plan run");
+                }
+                std::memcpy(line.data() + pos, previous.data() + pos, length);
+                break;
+            case RepeatRun: {
+                const int c = in.get();
+                if (c == std::char_traits<char>::eof()) {
+                    throw std::runtime_error("Truncated compact plan");
+                }
+                std::memset(line.data() + pos, c, length);
+                break;
+            }
+            case LiteralRun:
+                if (!in.read(line.data() + pos, length)) {
+                    throw std::runtime_error("Truncated compact plan");
+                }
+                break;
+            default:
+                throw std::runtime_error("Invalid compact plan run");
+            }
+            pos += length;
+        }
+        previous = line;
+        return true;
+    }
+};
+
+// Convert a text or compact plan to the compact or text format
+void convert_plan(std::istream& in, std::ostream& out, bool compact) {
+    std::optional<CompactPlanReader> reader;
+    if (is_compact_plan(in)) {
+        reader.emplace(in);
+    }
+    std::optional<CompactPlanWriter> writer;
+    if (compact) {
+        writer.emplace(out);
+    }
+    for (std::string line; reader ? reader->next_line(line) : static_cast<bool>(std::getline(in, line));) {
+        if (writer) {
+            writer->write_line(line);
+        } else {
+            out << line << '\n';
+        }
+    }
+}
+
+// Fill policies flood fill a room of the grid from the start position, marking filled cells Visited.
+// fill<Dialect>(grid, start, chair, door) calls chair(pos, chair class) for each filled chair cell,
+// door(pos) for door cells around the room, and returns the number of filled cells.
+
+// Non-recursive flood fill with the dialect neighborhood
+// (see https://en.wikipedia.org/wiki/Flood_fill)
+struct QueueFill {
+    static constexpr auto name = "queue";
+
+    template<typename Dialect, typename Grid, typename Chair, typename Door>
+    static constexpr size_t fill(Grid& grid, const Pos& start, Chair&& chair, Door&& door) {
+        size_t visited = 0;
+        typename Grid::Queue q;
+        const auto visit = [&](const Pos& new_pos) {
+            const int8_t new_cls = cell_class<Dialect>(grid.get(new_pos));
+            if (new_cls == DoorCell) {
+                door(new_pos); // don't pass through the door
+            } else if (new_cls != VisitedCell && new_cls != WallCell) {
+                q.push(new_pos);
+            }
+        };
+        q.push(start);
+        while (!q.empty()) {
+            auto pos = q.front(); q.pop();
+            if constexpr (Grid::tiled) {
+                // an open tile is visited as a whole, continue from the cells around it
+                if (Pos first, last; grid.visit_open_tile(pos, first, last)) {
+                    visited += (last.x - first.x + 1) * (last.y - first.y + 1);
+                    for (ssize_t x = first.x; x <= last.x; ++x) {
+                        visit({x, first.y - 1});
+                        visit({x, last.y + 1});
+                    }
+                    for (ssize_t y = first.y; y <= last.y; ++y) {
+                        visit({first.x - 1, y});
+                        visit({last.x + 1, y});
+                    }
+                    if constexpr (std::size(Dialect::neighbors) > 4) {
+                        // diagonal neighbors of the tile corners, unless squeezed between walls
+                        for (const Pos& corner : {first, Pos{last.x, first.y}, Pos{first.x, last.y}, last}) {
+                            const ssize_t dx = (corner.x == first.x ? -1 : 1), dy = (corner.y == first.y ? -1 : 1);
+                            if (cell_class<Dialect>(grid.get({corner.x + dx, corner.y})) != WallCell
+                                    || cell_class<Dialect>(grid.get({corner.x, corner.y + dy})) != WallCell) {
+                                visit({corner.x + dx, corner.y + dy});
+                            }
+                        }
+                    }
+                    continue;
+                }
+            }
+            const int8_t cls = cell_class<Dialect>(grid.get(pos));
+            if (cls == VisitedCell) {
+                continue;
+            } else if (cls >= 0) {
+                chair(pos, cls);
+            }
+            grid.set(pos, Visited);
+            ++visited;
+            for (const auto& [dx, dy] : Dialect::neighbors) {
+                if constexpr (std::size(Dialect::neighbors) > 4) {
+                    if (dx && dy && cell_class<Dialect>(grid.get({pos.x + dx, pos.y})) == WallCell
+                            && cell_class<Dialect>(grid.get({pos.x, pos.y + dy})) == WallCell) {
+                        continue; // squeeze between walls
+                    }
+                }
+                visit({pos.x + dx, pos.y + dy});
+            }
+        }
+        return visited;
+    }
+};
+
+// Scanline fill of horizontal cell runs, seeding the rows above and below once per run
+// (see https://en.wikipedia.org/wiki/Flood_fill#Span_filling). Dialects with diagonal
+// neighbors and tiled grids use the queue fill.
+struct SpanFill {
+    static constexpr auto name = "span";
+
+    template<typename Dialect, typename Grid, typename Chair, typename Door>
+    static size_t fill(Grid& grid, const Pos& start, Chair&& chair, Door&& door) {
+        if constexpr (std::size(Dialect::neighbors) > 4 || Grid::tiled) {
+            return QueueFill::fill<Dialect>(grid, start, chair, door);
+        } else {
+            size_t visited = 0;
+            // cell class, doors are reported when reached
+            const auto open = [&](const Pos& pos) {
+                const int8_t cls = cell_class<Dialect>(grid.get(pos));
+                if (cls == DoorCell) {
+                    door(pos);
+                }
+                return cls != DoorCell && cls != VisitedCell && cls != WallCell;
+            };
+            std::vector<Pos> seeds{start};
+            while (!seeds.empty()) {
+                const Pos seed = seeds.back();
+                seeds.pop_back();
+                if (!open(seed)) {
+                    continue;
+                }
+                ssize_t x = seed.x;
+                while (open({x - 1, seed.y})) {
+                    --x;
+                }
+                bool above = false, below = false; // seeded the current run of the row
+                for (; open({x, seed.y}); ++x) {
+                    const Pos pos{x, seed.y};
+                    if (const int8_t cls = cell_class<Dialect>(grid.get(pos)); cls >= 0) {
+                        chair(pos, cls);
+                    }
+                    grid.set(pos, Visited);
+                    ++visited;
+                    const Pos up{x, seed.y - 1}, down{x, seed.y + 1};
+                    const bool up_open = open(up), down_open = open(down);
+                    if (up_open && !above) {
+                        seeds.push_back(up);
+                    }
+                    if (down_open && !below) {
+                        seeds.push_back(down);
+                    }
+                    above = up_open;
+                    below = down_open;
+                }
+            }
+            return visited;
+        }
+    }
+};
+
+// Counter policies count chairs found by the fill in the room and the total
+struct ChairCounter {
+    static constexpr auto name = "counts";
+
+    void clear() {
+    }
+
+    void count(Room& room, Room& total, size_t /*index*/, int8_t cls, const Pos& /*pos*/) {
+        room.chairs[cls] += 1;
+        total.chairs[cls] += 1;
+    }
+};
+
+struct ChairPosition {
+    Pos pos;
+    size_t room; // index in the found rooms
+    int8_t type; // index in ChairTypes
+};
+
+// Chair counts, and positions of the chairs
+struct ChairPositions : ChairCounter {
+    static constexpr auto name = "positions";
+    std::vector<ChairPosition> chairs;
+
+    void clear() {
+        chairs.clear();
+    }
+
+    void count(Room& room, Room& total, size_t index, int8_t cls, const Pos& pos) {
+        ChairCounter::count(room, total, index, cls, pos);
+        chairs.push_back(ChairPosition{pos, index, cls});
+    }
+};
+
+// Plan with swappable policies of the cells storage, flood fill and chair counting
+// Calls found(name, open, close) for each room name `(name)` in the line, name without the surrounding
+// whitespace, open and close the offsets of the parentheses. Shared by BasicPlan and static_plan().
+template<typename Found>
+constexpr void for_each_room_name(std::string_view line, Found&& found) {
+    constexpr std::string_view Spaces = " \t\n\v\f\r";
+    for (size_t open = line.find('('); open != std::string_view::npos; open = line.find('(', open)) {
+        const size_t close = line.find(')', open + 1);
+        if (close == std::string_view::npos) {
+            break;
+        }
+        std::string_view name = line.substr(open + 1, close - open - 1);
+        name.remove_prefix(std::min(name.find_first_not_of(Spaces), name.size()));
+        name.remove_suffix(name.size() - std::min(name.find_last_not_of(Spaces) + 1, name.size()));
+        found(name, open, close);
+        open = close + 1;
+    }
+}
+
+template<typename Grid, typename Fill = QueueFill, typename Counter = ChairCounter>
+class BasicPlan {
+private:
+    Grid grid;
+    Counter counter;
+    std::vector<Room> rooms; // sorted by name after read
+    Doors doors;
+    size_t visited = 0;
+public:
+    void read(std::istream& input) {
+        PhaseScope phase(Phase::Read);
+        grid.clear();
+        rooms.clear();
+        std::optional<CompactPlanReader> compact;
+        if (is_compact_plan(input)) {
+            compact.emplace(input);
+        }
+        ssize_t y = 0;
+        for (std::string line; compact ? compact->next_line(line) : static_cast<bool>(std::getline(input, line)); line.clear()) {
+            transcode(line);
+            {
+                PhaseScope phase(Phase::Rooms);
+                find_rooms(line, y++);
+            }
+            grid.push_line(std::move(line));
+        }
+        grid.finish();
+
+        PhaseScope sort(Phase::Sort);
+        sort_rooms();
+    }
+
+    template<typename Dialect = Classic>
+    std::vector<Room> find_chairs_in_rooms() {
+        PhaseScope phase(Phase::Fill);
+        std::vector<Room> rooms;
+
+        Room total{"total"}; // pseudo room for total count
+        std::vector<std::pair<Pos, size_t>> door_rooms;
+        counter.clear();
+    
+        for (Room room : this->rooms) {
+            find_chairs<Dialect>(room, total, door_rooms, rooms.size() + 1);
+            rooms.push_back(room);
+        }
+        rooms.insert(rooms.begin(), total);
+        find_doors<Dialect>(rooms, door_rooms);
+        return rooms;
+    }
+
+    // room-door-room graph found by the last find_chairs_in_rooms()
+    const Doors& door_graph() const {
+        return doors;
+    }
+
+    // number of cells visited by find_chairs_in_rooms()
+    size_t visited_cells() const {
+        return visited;
+    }
+
+    // chair counter policy of the last find_chairs_in_rooms()
+    const Counter& chair_counter() const {
+        return counter;
+    }
+
+    const Grid& cells() const {
+        return grid;
+    }
+
+    // cells for a fill pass of its own, without chair counting
+    Grid& cells() {
+        return grid;
+    }
+
+    // rooms found by read(), sorted by name, without chair counts
+    const std::vector<Room>& named_rooms() const {
+        return rooms;
+    }
+private:
+    // Find room names in the line being read, and erase them
+    void find_rooms(std::string& line, ssize_t y) {
+        for_each_room_name(line, [&](std::string_view name, size_t open, size_t close) {
+            const auto pos = Pos{static_cast<ssize_t>(open), y};
+            if (name.empty()) {
+                throw std::runtime_error("Empty room name at " + pos.str());
+            }
+            rooms.emplace_back(std::string(name), pos, ChairCount{});
+            std::fill(line.begin() + open, line.begin() + close + 1, ' '); // erase room name in the plan
+        });
+    }
+
+    // Sort rooms by name, rooms are found in the plan order
+    void sort_rooms() {
+        radix_sort(rooms, [](const Room& room) -> std::string_view { return room.name; });
+        const auto duplicate = std::adjacent_find(rooms.begin(), rooms.end(),
+            [](const Room& a, const Room& b) { return a.name == b.name; });
+        if (duplicate != rooms.end()) {
+            throw std::runtime_error("Duplicate room name " + duplicate->name + ", initially defined at " + duplicate->pos.str());
+        }
+    }
+
+    // Group door cells touched by the room fills, door_rooms are (door position, room index) pairs.
+    // Adjacent door cells, like a door across a thick wall, are one door at its first cell.
+    template<typename Dialect>
+    void find_doors(const Rooms& rooms, std::vector<std::pair<Pos, size_t>>& door_rooms) {
+        doors.clear();
+        std::map<Pos, Pos> first_cell; // of the door, by its cells
+        for (auto& [pos, index] : door_rooms) {
+            if (!first_cell.count(pos)) {
+                std::vector<Pos> cells{pos};
+                first_cell[pos] = pos;
+                for (size_t i = 0; i < cells.size(); ++i) {
+                    for (const auto& [dx, dy] : Dialect::neighbors) {
+                        const Pos next{cells[i].x + dx, cells[i].y + dy};
+                        if (cell_class<Dialect>(grid.get(next)) == DoorCell && !first_cell.count(next)) {
+                            first_cell[next] = next;
+                            cells.push_back(next);
+                        }
+                    }
+                }
+                const Pos first = *std::min_element(cells.begin(), cells.end());
+                for (const Pos& cell : cells) {
+                    first_cell[cell] = first;
+                }
+            }
+            pos = first_cell[pos];
+        }
+        std::sort(door_rooms.begin(), door_rooms.end());
+        door_rooms.erase(std::unique(door_rooms.begin(), door_rooms.end()), door_rooms.end());
+        for (const auto& [pos, index] : door_rooms) {
+            if (doors.empty() || !(doors.back().pos == pos)) {
+                doors.push_back(Door{pos, {}});
+            }
+            doors.back().rooms.push_back(rooms[index].name);
+        }
+    }
+
+    template<typename Dialect>
+    void find_chairs(Room& room, Room& total, std::vector<std::pair<Pos, size_t>>& door_rooms, size_t index) {
+        visited += Fill::template fill<Dialect>(grid, room.pos,
+            [&](const Pos& pos, int8_t cls) { counter.count(room, total, index, cls, pos); },
+            [&](const Pos& pos) { door_rooms.emplace_back(pos, index); });
+    }
+};
+
+using Plan = BasicPlan<DenseGrid>;
+using SparsePlan = BasicPlan<SparseGrid>;
+
+// Shipped policy combinations, --test runs the plan tests for each of them
+using PlanTypes = std::tuple<Plan, SparsePlan, BasicPlan<DenseGrid, SpanFill>, BasicPlan<DenseGrid, QueueFill, ChairPositions>>;
+
+template<typename Grid, typename Fill, typename Counter>
+std::string plan_type_name(const BasicPlan<Grid, Fill, Counter>&) {
+    return std::string(Grid::name) + "/" + Fill::name + "/" + Counter::name;
+}
+
+// Plan analysis evaluated at compile time for embedded plans, e.g.
+//     constexpr auto layout = static_plan<std::string_view(plan).size()>(plan);
+//     static_assert(layout.find("kitchen")->chairs[0] == 4);
+// The plan must outlive the result, room names refer to it.
+// Cell labels of the layout give the room at a position without a flood fill at run time.
+template<size_t Size, size_t MaxRooms>
+struct StaticPlan {
+    struct StaticRoom {
+        std::string_view name;
+        Pos pos;
+        ChairCount chairs{};
+    };
+    std::array<StaticRoom, MaxRooms + 1> rooms{}; // total first, then sorted by name
+    size_t room_count = 1;
+    StaticGrid<Size> grid; // visited cells labeled with the index of their room
+
+    constexpr explicit StaticPlan(std::string_view plan)
+        : grid(plan)
+    {
+    }
+
+    constexpr const StaticRoom& total() const {
+        return rooms[0];
+    }
+
+    // room named name, or nullptr
+    constexpr const StaticRoom* find(std::string_view name) const {
+        size_t first = 1, last = room_count;
+        while (first < last) {
+            const size_t mid = first + (last - first) / 2;
+            if (rooms[mid].name < name) {
+                first = mid + 1;
+            } else {
+                last = mid;
+            }
+        }
+        return first < room_count && rooms[first].name == name ? &rooms[first] : nullptr;
+    }
+
+    // room containing pos, or nullptr
+    constexpr const StaticRoom* room_at(const Pos& pos) const {
+        const ssize_t offset = grid.offset(pos);
+        return offset >= 0 && grid.labels[offset] ? &rooms[grid.labels[offset]] : nullptr;
+    }
+};
+
+// BasicPlan::read and find_chairs_in_rooms with a StaticGrid, evaluated at compile time
+template<size_t Size, size_t MaxRooms = 64, typename Dialect = Classic>
+constexpr StaticPlan<Size, MaxRooms> static_plan(std::string_view plan) {
+    StaticPlan<Size, MaxRooms> result(plan);
+    auto& rooms = result.rooms;
+    auto& grid = result.grid;
+
+    // find room names, and erase them
+    for (size_t y = 0; y < grid.lines; ++y) {
+        const std::string_view line = plan.substr(grid.line_starts[y], grid.line(y).size());
+        for_each_room_name(line, [&](std::string_view name, size_t open, size_t close) {
+            if (name.empty()) {
+                throw std::runtime_error("Empty room name");
+            }
+            if (result.room_count > MaxRooms) {
+                throw std::runtime_error("Too many rooms in the static plan");
+            }
+            rooms[result.room_count++] = { name, Pos{static_cast<ssize_t>(open), static_cast<ssize_t>(y)} };
+            for (size_t x = open; x <= close; ++x) {
+                grid.set(Pos{static_cast<ssize_t>(x), static_cast<ssize_t>(y)}, ' ');
+            }
+        });
+    }
+
+    // stable insertion sort by name
+    for (size_t i = 2; i < result.room_count; ++i) {
+        for (size_t j = i; j > 1 && rooms[j].name < rooms[j - 1].name; --j) {
+            const auto room = rooms[j];
+            rooms[j] = rooms[j - 1];
+            rooms[j - 1] = room;
+        }
+    }
+    for (size_t i = 2; i < result.room_count; ++i) {
+        if (rooms[i].name == rooms[i - 1].name) {
+            throw std::runtime_error("Duplicate room name");
+        }
+    }
+
+    for (uint16_t index = 1; index < result.room_count; ++index) {
+        auto& room = rooms[index];
+        grid.label = index;
+        QueueFill::fill<Dialect>(grid, room.pos, [&](const Pos&, int8_t cls) {
+            room.chairs[cls] += 1;
+            rooms[0].chairs[cls] += 1;
+        }, [](const Pos&) {});
+    }
+    rooms[0].name = "total";
+    return result;
+}
+
+// Hierarchical path finding between plan cells (HPA*, see https://webdocs.cs.ualberta.ca/~mmueller/ps/hpastar.pdf).
+// The plan is split into square clusters, and cells of the cluster borders walkable on both sides form
+// entrances. Entrance nodes are connected by precomputed distances within their clusters, so a route
+// query searches only the clusters of its ends and the graph of entrances, by A* with the distances
+// to a few landmark nodes as the estimate. A route is at most EntranceSpacing steps longer than the
+// shortest path for each cluster border the shortest path crosses, to walk along the border to the
+// nearest entrance node and back, and one step more in 8-connected dialects, where the shortest path
+// can cross the border diagonally.
+template<typename Dialect = Classic>
+class RouteMap {
+public:
+    static constexpr ssize_t ClusterSize = 32;
+    static constexpr ssize_t EntranceSpacing = 4; // wider entrances get nodes at the ends and every few cells
+    static constexpr size_t Landmarks = 8; // nodes with distances to all nodes, for the A* estimate
+
+    struct Route {
+        size_t distance = 0; // number of steps
+        std::vector<Pos> waypoints; // from, entrance cells and to
+    };
+private:
+    static constexpr uint32_t None = UINT32_MAX;
+
+    struct Edge {
+        uint32_t node;
+        uint32_t cost;
+    };
+    ssize_t width = 0;
+    ssize_t height = 0;
+    std::vector<char> walkable; // row-major cells
+    std::vector<Pos> nodes;
+    std::vector<std::vector<Edge>> node_edges; // of each node while the map is built
+    std::vector<Edge> edges; // of each node after those of the previous node
+    std::vector<uint32_t> edges_begin; // first edge of each node, and the end
+    std::vector<std::array<uint32_t, Landmarks>> landmark_distance; // of each node, None if unreachable
+    std::vector<int32_t> node_at; // node of a cell, or -1
+    ssize_t clusters_x = 0;
+
+    // search state of queries, marked by the query number
+    struct Label {
+        uint32_t mark = 0;
+        uint32_t cost;
+        uint32_t estimate; // of the remaining cost
+        uint32_t parent;
+    };
+    mutable std::vector<Label> labels; // of each node and the goal
+    mutable uint32_t query = 0;
+
+    bool open(const Pos& pos) const {
+        return 0 <= pos.x && pos.x < width && 0 <= pos.y && pos.y < height && walkable[pos.y * width + pos.x];
+    }
+
+    size_t cluster(const Pos& pos) const {
+        return pos.y / ClusterSize * clusters_x + pos.x / ClusterSize;
+    }
+
+    uint32_t node(const Pos& pos) {
+        int32_t& node = node_at[pos.y * width + pos.x];
+        if (node < 0) {
+            node = nodes.size();
+            nodes.push_back(pos);
+            node_edges.emplace_back();
+        }
+        return node;
+    }
+
+    // Entrances of the border runs of cells walkable at a and at a + step
+    void add_entrances(Pos a, const Pos& along, const Pos& step, ssize_t length) {
+        ssize_t run = 0;
+        for (ssize_t i = 0; i <= length; ++i, a = {a.x + along.x, a.y + along.y}) {
+            if (i < length && open(a) && open({a.x + step.x, a.y + step.y})) {
+                ++run;
+                continue;
+            }
+            const auto entrance = [&](ssize_t back) {
+                const Pos from{a.x - along.x * back, a.y - along.y * back}, to{from.x + step.x, from.y + step.y};
+                const uint32_t n = node(from), m = node(to);
+                node_edges[n].push_back({m, 1});
+                node_edges[m].push_back({n, 1});
+            };
+            if (run > EntranceSpacing) {
+                for (ssize_t back = run; back > 1; back -= EntranceSpacing) {
+                    entrance(back);
+                }
+                entrance(1);
+            } else if (run > 0) {
+                entrance(run / 2 + 1);
+            }
+            run = 0;
+        }
+    }
+
+    // Breadth first search within the cluster of from, calls reached(pos, distance) for reached cells
+    template<typename Reached>
+    void cluster_search(const Pos& from, Reached&& reached) const {
+        const Pos first{from.x / ClusterSize * ClusterSize, from.y / ClusterSize * ClusterSize};
+        std::array<uint16_t, ClusterSize * ClusterSize> distance;
+        distance.fill(UINT16_MAX);
+        std::array<Pos, ClusterSize * ClusterSize> queue;
+        size_t head = 0, tail = 0;
+        const auto index = [&first](const Pos& pos) { return (pos.y - first.y) * ClusterSize + pos.x - first.x; };
+        distance[index(from)] = 0;
+        queue[tail++] = from;
+        while (head < tail) {
+            const Pos pos = queue[head++];
+            reached(pos, distance[index(pos)]);
+            for (const auto& [dx, dy] : Dialect::neighbors) {
+                const Pos next{pos.x + dx, pos.y + dy};
+                if (dx != 0 && dy != 0 && !open({next.x, pos.y}) && !open({pos.x, next.y})) {
+                    continue; // squeezing between walls
+                }
+                if (first.x <= next.x && next.x < first.x + ClusterSize && first.y <= next.y && next.y < first.y + ClusterSize
+                        && open(next) && distance[index(next)] == UINT16_MAX) {
+                    distance[index(next)] = distance[index(pos)] + 1;
+                    queue[tail++] = next;
+                }
+            }
+        }
+    }
+
+    // Distances from the node to all nodes through the entrance graph, None if unreachable
+    std::vector<uint32_t> node_distances(uint32_t source) const {
+        std::vector<uint32_t> distance(nodes.size(), None);
+        using Item = std::pair<uint32_t, uint32_t>; // distance, node
+        std::priority_queue<Item, std::vector<Item>, std::greater<Item>> q;
+        distance[source] = 0;
+        q.emplace(0, source);
+        while (!q.empty()) {
+            const auto [d, n] = q.top();
+            q.pop();
+            if (d != distance[n]) {
+                continue; // outdated
+            }
+            for (uint32_t e = edges_begin[n]; e < edges_begin[n + 1]; ++e) {
+                if (d + edges[e].cost < distance[edges[e].node]) {
+                    distance[edges[e].node] = d + edges[e].cost;
+                    q.emplace(d + edges[e].cost, edges[e].node);
+                }
+            }
+        }
+        return distance;
+    }
+
+    // Landmarks spread out by choosing the node farthest from the previous ones each time (ALT, Goldberg and
+    // Harrelson, "Computing the Shortest Path: A* Search Meets Graph Theory", 2005). By the triangle inequality
+    // |d(landmark, n) - d(landmark, goal)| is at most the distance from n to the goal.
+    void add_landmarks() {
+        landmark_distance.resize(nodes.size());
+        std::vector<uint32_t> nearest(nodes.size(), None); // distance to the nearest landmark
+        uint32_t landmark = 0;
+        for (size_t i = 0; i < Landmarks && !nodes.empty(); ++i) {
+            const std::vector<uint32_t> distance = node_distances(landmark);
+            for (uint32_t n = 0; n < nodes.size(); ++n) {
+                landmark_distance[n][i] = distance[n];
+                nearest[n] = std::min(nearest[n], distance[n]);
+            }
+            for (uint32_t n = 0; n < nodes.size(); ++n) {
+                if (nearest[n] != None && (nearest[landmark] == None || nearest[n] > nearest[landmark])) {
+                    landmark = n;
+                }
+            }
+        }
+    }
+public:
+    // Route map of the plan cells walkable in the dialect
+    static RouteMap build(const DenseGrid& grid) {
+        RouteMap map;
+        map.width = grid.width();
+        map.height = grid.height();
+        map.walkable.resize(map.width * map.height);
+        for (ssize_t y = 0; y < map.height; ++y) {
+            for (ssize_t x = 0; x < map.width; ++x) {
+                map.walkable[y * map.width + x] = cell_class<Dialect>(grid.get({x, y})) != WallCell;
+            }
+        }
+        map.node_at.assign(map.walkable.size(), -1);
+        map.clusters_x = (map.width + ClusterSize - 1) / ClusterSize;
+        for (ssize_t y = 0; y < map.height; y += ClusterSize) {
+            for (ssize_t x = 0; x < map.width; x += ClusterSize) {
+                if (x + ClusterSize < map.width) {
+                    map.add_entrances({x + ClusterSize - 1, y}, {0, 1}, {1, 0}, std::min(ClusterSize, map.height - y));
+                }
+                if (y + ClusterSize < map.height) {
+                    map.add_entrances({x, y + ClusterSize - 1}, {1, 0}, {0, 1}, std::min(ClusterSize, map.width - x));
+                }
+            }
+        }
+        // distances between the entrance nodes of each cluster
+        for (uint32_t n = 0; n < map.nodes.size(); ++n) {
+            map.cluster_search(map.nodes[n], [&map, n](const Pos& pos, uint32_t distance) {
+                const int32_t m = map.node_at[pos.y * map.width + pos.x];
+                if (m >= 0 && static_cast<uint32_t>(m) != n) {
+                    map.node_edges[n].push_back({static_cast<uint32_t>(m), distance});
+                }
+            });
+        }
+        // all edges in one array, without the edges as long as a path through another node
+        std::vector<uint32_t> cost(map.nodes.size(), None);
+        for (uint32_t n = 0; n < map.nodes.size(); ++n) {
+            for (const Edge& edge : map.node_edges[n]) {
+                cost[edge.node] = edge.cost;
+            }
+            for (const Edge& first : map.node_edges[n]) {
+                for (const Edge& second : map.node_edges[first.node]) {
+                    if (first.cost + second.cost == cost[second.node]) {
+                        cost[second.node] = 0; // the edge isn't needed, the path is as short
+                    }
+                }
+            }
+            map.edges_begin.push_back(map.edges.size());
+            for (const Edge& edge : map.node_edges[n]) {
+                if (cost[edge.node] != 0) {
+                    map.edges.push_back(edge);
+                }
+                cost[edge.node] = None;
+            }
+        }
+        map.edges_begin.push_back(map.edges.size());
+        map.node_edges = {};
+        map.add_landmarks();
+        map.labels.resize(map.nodes.size() + 1);
+        return map;
+    }
+
+    size_t node_count() const {
+        return nodes.size();
+    }
+
+    // Shortest route through the entrances, not thread-safe
+    std::optional<Route> route(const Pos& from, const Pos& to) const {
+        if (!open(from) || !open(to)) {
+            return std::nullopt;
+        }
+        const uint32_t goal = nodes.size();
+        std::vector<std::pair<uint32_t, uint32_t>> to_goal; // entrance node and distance to the goal
+        cluster_search(to, [&](const Pos& pos, uint32_t distance) {
+            if (const int32_t n = node_at[pos.y * width + pos.x]; n >= 0) {
+                to_goal.emplace_back(n, distance);
+            }
+        });
+        if (++query == 0) {
+            std::fill(labels.begin(), labels.end(), Label{});
+            query = 1;
+        }
+        // landmark distances of the goal, through the entrance nodes of its cluster
+        std::array<uint32_t, Landmarks> goal_distance;
+        goal_distance.fill(None);
+        for (const auto& [n, distance] : to_goal) {
+            for (size_t i = 0; i < Landmarks; ++i) {
+                if (landmark_distance[n][i] != None) {
+                    goal_distance[i] = std::min(goal_distance[i], landmark_distance[n][i] + distance);
+                }
+            }
+        }
+        using Item = std::pair<uint32_t, uint32_t>; // estimated cost, node
+        std::priority_queue<Item, std::vector<Item>, std::greater<Item>> open_nodes;
+        const auto estimate = [&](uint32_t n) {
+            if (n == goal) {
+                return 0u;
+            }
+            const Pos& pos = nodes[n];
+            uint32_t estimate = static_cast<uint32_t>(std::size(Dialect::neighbors) > 4
+                ? std::max(std::abs(pos.x - to.x), std::abs(pos.y - to.y)) : std::abs(pos.x - to.x) + std::abs(pos.y - to.y));
+            for (size_t i = 0; i < Landmarks; ++i) {
+                const uint32_t a = landmark_distance[n][i], b = goal_distance[i];
+                if (a != None && b != None) {
+                    estimate = std::max(estimate, a > b ? a - b : b - a);
+                }
+            }
+            return estimate;
+        };
+        const auto relax = [&](uint32_t n, uint32_t new_cost, uint32_t from_node) {
+            if (Label& label = labels[n]; label.mark != query) {
+                label = {query, new_cost, estimate(n), from_node};
+                open_nodes.emplace(new_cost + label.estimate, n);
+            } else if (new_cost < label.cost) {
+                label.cost = new_cost;
+                label.parent = from_node;
+                open_nodes.emplace(new_cost + label.estimate, n);
+            }
+        };
+        cluster_search(from, [&](const Pos& pos, uint32_t distance) {
+            if (pos == to) {
+                relax(goal, distance, None);
+            } else if (const int32_t n = node_at[pos.y * width + pos.x]; n >= 0) {
+                relax(n, distance, None);
+            }
+        });
+        const size_t goal_cluster = cluster(to);
+        while (!open_nodes.empty()) {
+            const auto [estimated, n] = open_nodes.top();
+            open_nodes.pop();
+            const uint32_t cost = labels[n].cost;
+            if (estimated != cost + labels[n].estimate) {
+                continue; // outdated
+            }
+            if (n == goal) {
+                Route route{cost, {to}};
+                for (uint32_t p = labels[goal].parent; p != None; p = labels[p].parent) {
+                    route.waypoints.push_back(nodes[p]);
+                }
+                if (!(route.waypoints.back() == from)) {
+                    route.waypoints.push_back(from);
+                }
+                std::reverse(route.waypoints.begin(), route.waypoints.end());
+                return route;
+            }
+            for (uint32_t e = edges_begin[n]; e < edges_begin[n + 1]; ++e) {
+                relax(edges[e].node, cost + edges[e].cost, n);
+            }
+            if (cluster(nodes[n]) == goal_cluster) {
+                for (const auto& [m, distance] : to_goal) {
+                    if (m == n) {
+                        relax(goal, cost + distance, n);
+                    }
+                }
+            }
+        }
+        return std::nullopt;
+    }
+};
+
+// Delivery simulation parameters, times are seconds per cell move
+struct SimulationOptions {
+    size_t workers = 0; // simulate with this crew size when not 0
+    Pos entrance; // where chairs are brought in
+    double walk = 1; // without a chair
+    std::array<double, ChairTypes.size()> carry = { 1.5, 1.2, 3, 1.5 }; // with a chair of each type
+};
+
+struct SimulationResult {
+    struct Worker {
+        size_t chairs = 0;
+        double busy = 0; // time of the last trip end
+        double waiting = 0; // in narrow passages
+    };
+    std::vector<Worker> workers;
+    size_t chairs = 0; // delivered
+    size_t unreachable = 0; // chairs without a route from the entrance
+    size_t narrow_cells = 0; // on the delivery routes
+    double time = 0; // of the last delivery trip end
+
+    void print(std::ostream& out) const {
+        out << "chairs: " << chairs << ", unreachable: " << unreachable << ", narrow cells: " << narrow_cells << '\n'
+            << "time: " << time << " s\n";
+        for (size_t i = 0; i < workers.size(); ++i) {
+            out << "worker " << i + 1 << ": chairs " << workers[i].chairs << ", busy " << workers[i].busy
+                << " s, waiting " << workers[i].waiting << " s\n";
+        }
+    }
+};
+
+// Discrete-event simulation of workers carrying chairs from the entrance to the chair positions
+// by the shortest routes and walking back. Narrow passage cells, with walls on both sides, are
+// passed by one worker at a time and others wait for them. The farthest chairs are delivered first.
+template<typename Dialect = Classic>
+SimulationResult simulate_delivery(const DenseGrid& grid, const std::vector<ChairPosition>& chairs, const SimulationOptions& options) {
+    const ssize_t width = grid.width(), height = grid.height();
+    const auto index = [width](const Pos& pos) { return pos.y * width + pos.x; };
+    const auto open = [&](const Pos& pos) {
+        return 0 <= pos.x && pos.x < width && 0 <= pos.y && pos.y < height && cell_class<Dialect>(grid.get(pos)) != WallCell;
+    };
+    if (options.workers == 0 || !open(options.entrance)) {
+        throw std::runtime_error("Simulation needs workers and an open entrance cell");
+    }
+
+    // shortest routes to the entrance
+    std::vector<int32_t> distance(width * height, -1);
+    std::vector<Pos> parent(width * height);
+    std::queue<Pos> q;
+    distance[index(options.entrance)] = 0;
+    q.push(options.entrance);
+    while (!q.empty()) {
+        const Pos pos = q.front();
+        q.pop();
+        for (const auto& [dx, dy] : Dialect::neighbors) {
+            const Pos next{pos.x + dx, pos.y + dy};
+            if (dx != 0 && dy != 0 && !open({next.x, pos.y}) && !open({pos.x, next.y})) {
+                continue; // squeezing between walls
+            }
+            if (open(next) && distance[index(next)] < 0) {
+                distance[index(next)] = distance[index(pos)] + 1;
+                parent[index(next)] = pos;
+                q.push(next);
+            }
+        }
+    }
+    std::vector<int32_t> narrow(width * height, -1); // narrow cell number
+    size_t narrow_cells = 0;
+    const auto narrow_cell = [&](const Pos& pos) {
+        int32_t& n = narrow[index(pos)];
+        if (n < 0 && ((!open({pos.x - 1, pos.y}) && !open({pos.x + 1, pos.y})) || (!open({pos.x, pos.y - 1}) && !open({pos.x, pos.y + 1})))) {
+            n = narrow_cells++;
+        }
+        return n;
+    };
+
+    // trips are steps of cell runs without narrow cells, or a single narrow cell
+    struct Step {
+        int32_t narrow; // or -1 for a run
+        uint32_t cells;
+        double time; // per cell
+    };
+    struct Trip {
+        std::vector<Step> steps;
+        const ChairPosition* chair;
+    };
+    SimulationResult result;
+    std::vector<Trip> trips;
+    for (const ChairPosition& chair : chairs) {
+        if (distance[index(chair.pos)] < 0) {
+            ++result.unreachable;
+            continue;
+        }
+        // cells from the chair back to the entrance
+        std::vector<Pos> route;
+        for (Pos pos = chair.pos; !(pos == options.entrance); pos = parent[index(pos)]) {
+            route.push_back(pos);
+        }
+        Trip trip{{}, &chair};
+        const auto add = [&trip](int32_t narrow, double time) {
+            if (narrow < 0 && !trip.steps.empty() && trip.steps.back().narrow < 0 && trip.steps.back().time == time) {
+                ++trip.steps.back().cells;
+            } else {
+                trip.steps.push_back(Step{narrow, 1, time});
+            }
+        };
+        for (auto it = route.rbegin(); it != route.rend(); ++it) {
+            add(narrow_cell(*it), options.carry[chair.type]);
+        }
+        for (size_t i = 1; i < route.size(); ++i) {
+            add(narrow_cell(route[i]), options.walk);
+        }
+        if (!route.empty()) {
+            add(narrow_cell(options.entrance), options.walk);
+        }
+        trips.push_back(std::move(trip));
+    }
+    std::stable_sort(trips.begin(), trips.end(), [&](const Trip& a, const Trip& b) {
+        return distance[index(a.chair->pos)] > distance[index(b.chair->pos)];
+    });
+
+    // events are workers reaching their next trip step
+    struct State {
+        const Trip* trip = nullptr;
+        size_t step = 0;
+    };
+    std::vector<State> states(options.workers);
+    result.workers.resize(options.workers);
+    std::vector<double> narrow_free(narrow_cells); // time when a narrow cell is free
+    using Event = std::pair<double, size_t>; // time, worker
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    for (size_t w = 0; w < options.workers; ++w) {
+        events.emplace(0.0, w);
+    }
+    size_t next_trip = 0;
+    while (!events.empty()) {
+        auto [time, w] = events.top();
+        events.pop();
+        State& state = states[w];
+        if (state.trip && state.step == state.trip->steps.size()) {
+            result.workers[w].chairs += 1;
+            result.workers[w].busy = time;
+            state.trip = nullptr;
+        }
+        if (!state.trip) {
+            if (next_trip == trips.size()) {
+                continue; // done
+            }
+            state = State{&trips[next_trip++], 0};
+            if (state.trip->steps.empty()) {
+                events.emplace(time, w); // chair at the entrance
+                continue;
+            }
+        }
+        const Step& step = state.trip->steps[state.step++];
+        if (step.narrow >= 0) {
+            double& free = narrow_free[step.narrow];
+            result.workers[w].waiting += std::max(0.0, free - time);
+            time = std::max(time, free) + step.time;
+            free = time;
+        } else {
+            time += step.cells * step.time;
+        }
+        events.emplace(time, w);
+    }
+    for (const auto& worker : result.workers) {
+        result.chairs += worker.chairs;
+        result.time = std::max(result.time, worker.busy);
+    }
+    result.narrow_cells = narrow_cells;
+    return result;
+}
+
+// Wall clearance of the grid cells, the Chebyshev distance to the nearest wall or outside cell:
+// 0 for walls, 1 for open cells next to a wall, and so on. A square footprint of side 2 * c - 1
+// centered at a cell with clearance c touches no wall. Computed by a breadth first search from all
+// walls at once, level by level, in linear time.
+template<typename Dialect = Classic>
+class ClearanceMap {
+private:
+    ssize_t width = 0;
+    ssize_t height = 0;
+    std::vector<uint16_t> clearance;
+public:
+    explicit ClearanceMap(const DenseGrid& grid)
+        : width(grid.width())
+        , height(grid.height())
+        , clearance(width * height, UINT16_MAX)
+    {
+        std::vector<Pos> frontier, next;
+        for (ssize_t y = 0; y < height; ++y) {
+            for (ssize_t x = 0; x < width; ++x) {
+                const bool border = (x == 0 || y == 0 || x + 1 == width || y + 1 == height);
+                if (cell_class<Dialect>(grid.get({x, y})) == WallCell) {
+                    clearance[y * width + x] = 0;
+                    frontier.push_back({x, y});
+                } else if (border) {
+                    clearance[y * width + x] = 1; // next to the outside
+                    next.push_back({x, y});
+                }
+            }
+        }
+        for (uint16_t level = 1; !frontier.empty() || !next.empty(); ++level) {
+            for (const Pos& pos : frontier) {
+                for (ssize_t dy = -1; dy <= 1; ++dy) {
+                    for (ssize_t dx = -1; dx <= 1; ++dx) {
+                        const Pos cell{pos.x + dx, pos.y + dy};
+                        if (0 <= cell.x && cell.x < width && 0 <= cell.y && cell.y < height && clearance[cell.y * width + cell.x] == UINT16_MAX) {
+                            clearance[cell.y * width + cell.x] = level;
+                            next.push_back(cell);
+                        }
+                    }
+                }
+            }
+            frontier.swap(next);
+            next.clear();
+        }
+    }
+
+    // clearance of the cell, 0 outside of the grid
+    uint16_t at(const Pos& pos) const {
+        return 0 <= pos.x && pos.x < width && 0 <= pos.y && pos.y < height ? clearance[pos.y * width + pos.x] : 0;
+    }
+
+    // Cells reachable from the start by a footprint center through cells with at least min_clearance
+    std::vector<char> reachable(const Pos& start, uint16_t min_clearance) const {
+        std::vector<char> reached(width * height);
+        std::vector<Pos> frontier, next;
+        if (at(start) >= min_clearance) {
+            reached[start.y * width + start.x] = true;
+            frontier.push_back(start);
+        }
+        while (!frontier.empty()) {
+            for (const Pos& pos : frontier) {
+                for (const auto& [dx, dy] : Dialect::neighbors) {
+                    const Pos cell{pos.x + dx, pos.y + dy};
+                    if (dx != 0 && dy != 0 && at({cell.x, pos.y}) < min_clearance && at({pos.x, cell.y}) < min_clearance) {
+                        continue; // squeezing between walls
+                    }
+                    if (at(cell) >= min_clearance && !reached[cell.y * width + cell.x]) {
+                        reached[cell.y * width + cell.x] = true;
+                        next.push_back(cell);
+                    }
+                }
+            }
+            frontier.swap(next);
+            next.clear();
+        }
+        return reached;
+    }
+
+    // Whether the footprint positioned in the reached cells can cover the cell
+    bool covers(const std::vector<char>& reached, const Pos& pos, uint16_t min_clearance) const {
+        const ssize_t radius = min_clearance - 1;
+        for (ssize_t y = std::max<ssize_t>(0, pos.y - radius); y <= std::min(height - 1, pos.y + radius); ++y) {
+            for (ssize_t x = std::max<ssize_t>(0, pos.x - radius); x <= std::min(width - 1, pos.x + radius); ++x) {
+                if (reached[y * width + x]) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+// Square footprint side of each chair type, in cells
+using ChairFootprints = std::array<uint16_t, ChairTypes.size()>;
+constexpr ChairFootprints DefaultFootprints = { 1, 1, 3, 1 };
+
+// Whether each chair fits on a route from the entrance with its footprint
+template<typename Dialect = Classic>
+std::vector<bool> check_clearance(const DenseGrid& grid, const std::vector<ChairPosition>& chairs, const Pos& entrance,
+        const ChairFootprints& footprints = DefaultFootprints) {
+    const ClearanceMap<Dialect> map(grid);
+    if (map.at(entrance) == 0) {
+        throw std::runtime_error("Clearance check needs an open entrance cell");
+    }
+    std::vector<std::vector<char>> reached(*std::max_element(footprints.begin(), footprints.end()) / 2 + 2);
+    std::vector<bool> fits;
+    fits.reserve(chairs.size());
+    for (const ChairPosition& chair : chairs) {
+        const uint16_t min_clearance = footprints[chair.type] / 2 + 1;
+        if (reached[min_clearance].empty()) {
+            reached[min_clearance] = map.reachable(entrance, min_clearance);
+        }
+        fits.push_back(map.covers(reached[min_clearance], chair.pos, min_clearance));
+    }
+    return fits;
+}
+
+// Options of a single plan processing
+struct PlanOptions {
+    std::string dialect = Classic::name;
+    bool doors = false;
+    bool sparse = false;
+};
+
+// Analyze a plan and pass the found rooms and doors to output,
+// doors are found only when requested by options
+template<typename Output>
+void analyze_plan(std::istream& input, const PlanOptions& options, Output&& output) {
+    MetricsShard& metrics = Metrics::local();
+    std::array<uint64_t, PhaseNames.size()> phase_start;
+    for (size_t i = 0; i < PhaseNames.size(); ++i) {
+        phase_start[i] = PhaseScope::nanoseconds(static_cast<Phase>(i));
+    }
+    const auto analyze = [&](auto& plan) {
+        plan.read(input);
+
+        with_dialect(options.dialect, [&](auto dialect) {
+            const Rooms rooms = plan.template find_chairs_in_rooms<decltype(dialect)>();
+            PhaseScope phase(Phase::Output);
+            output(rooms, options.doors ? plan.door_graph() : Doors{});
+        });
+        MetricsShard::add(metrics.cells, plan.visited_cells());
+    };
+    try {
+        if (options.sparse) {
+            SparsePlan plan;
+            analyze(plan);
+        } else {
+            Plan plan;
+            analyze(plan);
+        }
+    } catch (...) {
+        MetricsShard::add(metrics.errors, 1);
+        throw;
+    }
+    MetricsShard::add(metrics.plans, 1);
+    if (stats_enabled) {
+        PhaseScope other(Phase::Other); // account the last phase time
+        for (size_t i = 1; i < PhaseNames.size(); ++i) {
+            metrics.phases[i].observe(PhaseScope::nanoseconds(static_cast<Phase>(i)) - phase_start[i]);
+        }
+    }
+}
+
+// Analyze a plan and print results
+void process_plan(std::istream& input, const PlanOptions& options, std::ostream& out) {
+    analyze_plan(input, options, [&](const Rooms& rooms, const Doors& doors) {
+        for (const Room& room : rooms) {
+            out << room.name << ":\n" << room.chairs_str() << '\n';
+        }
+        if (options.doors) {
+            out << "doors:\n" << doors;
+        }
+        out.flush();
+    });
+}
+
+// Analysis results of a plan in flat arrays, with room lookup by name through a minimal perfect hash.
+// Room ids are indexes of the rooms, the total 0 and then rooms sorted by name. The total is not
+// looked up by name, a room can be named "total" too
+class CompiledPlan {
+private:
+    std::string names; // concatenated room names
+    std::vector<uint32_t> name_ends; // end of each room name in names
+    std::vector<ChairCount> chairs;
+    // CHD minimal perfect hash (see http://cmph.sourceforge.net/papers/esa09.pdf): keys are
+    // hashed to buckets, buckets are placed into the free slots by their displacement seeds,
+    // single key buckets store the slot directly as a negative displacement
+    uint64_t salt = 0;
+    std::vector<int32_t> displacements; // per bucket
+    std::vector<uint32_t> slot_ids; // room id of each slot, room ids from 1
+
+    static uint64_t mix(uint64_t x) {
+        // splitmix64 finalizer
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    static uint64_t hash(std::string_view name, uint64_t salt) {
+        uint64_t h = 0xCBF29CE484222325ull ^ salt; // FNV-1a
+        for (char c : name) {
+            h = (h ^ static_cast<uint8_t>(c)) * 0x100000001B3ull;
+        }
+        return mix(h);
+    }
+
+    size_t bucket(uint64_t h) const {
+        return (h >> 32) % displacements.size();
+    }
+
+    size_t slot(uint64_t h, int32_t displacement) const {
+        return displacement < 0 ? ~displacement : mix(h + displacement * 0x9E3779B97F4A7C15ull) % slot_ids.size();
+    }
+
+    // Returns false when the buckets can't be placed with this salt
+    bool build_hash(uint64_t salt) {
+        const size_t count = size() - 1;
+        this->salt = salt;
+        displacements.assign(count / 2 + 1, 0);
+        slot_ids.assign(count, 0);
+        std::vector<uint64_t> hashes(count);
+        std::vector<uint32_t> bucket_sizes(displacements.size() + 1), bucket_keys(count);
+        for (size_t key = 0; key < count; ++key) {
+            hashes[key] = hash(name(key + 1), salt);
+            ++bucket_sizes[bucket(hashes[key]) + 1];
+        }
+        // keys grouped by bucket with a counting sort
+        std::vector<uint32_t> bucket_starts(bucket_sizes.size());
+        for (size_t b = 1; b < bucket_sizes.size(); ++b) {
+            bucket_starts[b] = bucket_starts[b - 1] + bucket_sizes[b];
+        }
+        std::vector<uint32_t> next = bucket_starts;
+        for (size_t key = 0; key < count; ++key) {
+            bucket_keys[next[bucket(hashes[key])]++] = key;
+        }
+        // place larger buckets first, ordered by size with a counting sort too
+        std::vector<uint32_t> order(displacements.size());
+        size_t max_size = 0;
+        for (size_t b = 0; b < displacements.size(); ++b) {
+            max_size = std::max<size_t>(max_size, bucket_sizes[b + 1]);
+        }
+        std::vector<uint32_t> size_starts(max_size + 2);
+        for (size_t b = 0; b < displacements.size(); ++b) {
+            ++size_starts[max_size - bucket_sizes[b + 1] + 1];
+        }
+        for (size_t i = 1; i < size_starts.size(); ++i) {
+            size_starts[i] += size_starts[i - 1];
+        }
+        for (size_t b = 0; b < displacements.size(); ++b) {
+            order[size_starts[max_size - bucket_sizes[b + 1]]++] = b;
+        }
+
+        constexpr int32_t MaxDisplacement = 1 << 20;
+        std::vector<char> taken(count);
+        std::vector<size_t> slots;
+        size_t free_slot = 0;
+        for (uint32_t b : order) {
+            const uint32_t* keys = bucket_keys.data() + bucket_starts[b];
+            const size_t size = bucket_sizes[b + 1];
+            if (size == 0) {
+                break;
+            } else if (size == 1) {
+                while (taken[free_slot]) {
+                    ++free_slot;
+                }
+                displacements[b] = ~static_cast<int32_t>(free_slot);
+                taken[free_slot] = true;
+                slot_ids[free_slot] = keys[0] + 1;
+                continue;
+            }
+            int32_t displacement = 0;
+            for (;; ++displacement) {
+                if (displacement == MaxDisplacement) {
+                    return false;
+                }
+                slots.clear();
+                for (size_t i = 0; i < size; ++i) {
+                    const size_t s = slot(hashes[keys[i]], displacement);
+                    if (taken[s] || std::find(slots.begin(), slots.end(), s) != slots.end()) {
+                        break;
+                    }
+                    slots.push_back(s);
+                }
+                if (slots.size() == size) {
+                    break;
+                }
+            }
+            displacements[b] = displacement;
+            for (size_t i = 0; i < size; ++i) {
+                taken[slots[i]] = true;
+                slot_ids[slots[i]] = keys[i] + 1;
+            }
+        }
+        return true;
+    }
+public:
+    // Compile analysis results of find_chairs_in_rooms(), the total first and rooms with unique names
+    explicit CompiledPlan(const Rooms& rooms) {
+        if (rooms.empty()) {
+            throw std::runtime_error("No total in the compiled rooms");
+        }
+        name_ends.reserve(rooms.size());
+        chairs.reserve(rooms.size());
+        for (const Room& room : rooms) {
+            names += room.name;
+            name_ends.push_back(names.size());
+            chairs.push_back(room.chairs);
+        }
+        for (uint64_t salt = 0; !build_hash(salt); ++salt) {
+            if (salt == 16) {
+                throw std::runtime_error("Can't build room name hash");
+            }
+        }
+    }
+
+    size_t size() const {
+        return name_ends.size();
+    }
+
+    std::string_view name(size_t id) const {
+        const size_t begin = (id == 0 ? 0 : name_ends[id - 1]);
+        return std::string_view(names).substr(begin, name_ends[id] - begin);
+    }
+
+    const ChairCount& chair_count(size_t id) const {
+        return chairs[id];
+    }
+
+    // Room id of the name, not the total, with one hash and one name comparison
+    std::optional<size_t> find(std::string_view name) const {
+        if (slot_ids.empty()) {
+            return std::nullopt;
+        }
+        const uint64_t h = hash(name, salt);
+        const size_t id = slot_ids[slot(h, displacements[bucket(h)])];
+        return this->name(id) == name ? std::optional<size_t>{id} : std::nullopt;
+    }
+};
+
+// Analyze a plan and print the room named name
+void process_room_query(std::istream& input, const PlanOptions& options, const std::string& name, std::ostream& out) {
+    analyze_plan(input, options, [&](const Rooms& rooms, const Doors&) {
+        const CompiledPlan compiled(rooms);
+        const auto id = compiled.find(name);
+        if (!id) {
+            throw std::runtime_error("Unknown room " + name);
+        }
+        out << name << ":\n" << Room{name, {}, compiled.chair_count(*id)}.chairs_str() << '\n';
+    });
+}
+
+// Line index of a plan file, saved next to it as the .idx sidecar, to read
+// the lines of a region or of a single room with pread instead of the whole file.
+// The sidecar is the magic line and varints: plan file size and modification time,
+// ASCII flag, dialect name, line count and deltas of line starts, room count
+// and for each room its name and bounding box of the cells with the walls around.
+// Plain text plans only, compact and gzip plans have no line offsets.
+class LineIndex {
+public:
+    static constexpr std::string_view Magic = "CHAIRIDX1\n";
+
+    struct RoomBox {
+        std::string name;
+        Pos first, last;
+    };
+
+    std::string dialect = Classic::name;
+    bool ascii = true; // line bytes are cells, so regions are read without whole lines
+    std::vector<uint64_t> starts; // line start offsets and the file size
+    std::vector<RoomBox> rooms; // sorted by name
+
+    static std::string sidecar(const std::string& plan_path) {
+        return plan_path + ".idx";
+    }
+
+    // Scan the plan file for line starts and analyze it for the room bounds
+    static LineIndex build(const std::string& path, const PlanOptions& options) {
+        LineIndex index;
+        index.dialect = options.dialect;
+        index.stat(path);
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+        }
+        index.starts.assign(1, 0);
+        std::vector<char> buffer(1 << 20);
+        uint64_t offset = 0;
+        for (ssize_t n; (n = ::read(fd, buffer.data(), buffer.size())) != 0; offset += std::max<ssize_t>(n, 0)) {
+            if (n < 0 && errno != EINTR) {
+                ::close(fd);
+                throw std::runtime_error("Can't read " + path + ": " + std::strerror(errno));
+            }
+            if (n > 0 && offset == 0 && buffer[0] == 0x1F) {
+                ::close(fd);
+                throw std::runtime_error("Can't index a compressed plan " + path);
+            }
+            find_newlines(buffer.data(), std::max<ssize_t>(n, 0), offset, index.starts);
+            index.ascii = index.ascii && find_non_ascii(buffer.data(), std::max<ssize_t>(n, 0)) == static_cast<size_t>(std::max<ssize_t>(n, 0));
+        }
+        ::close(fd);
+        if (index.starts.back() != offset) {
+            index.starts.push_back(offset); // last line without a newline
+        }
+        if (offset != index.size) {
+            throw std::runtime_error("Plan " + path + " changed while indexing");
+        }
+
+        std::ifstream input(path, std::ios::binary);
+        if (is_compact_plan(input)) {
+            throw std::runtime_error("Can't index a compact plan " + path);
+        }
+        Plan plan;
+        plan.read(input);
+        with_dialect(options.dialect, [&](auto dialect) {
+            // a single fill of the rooms found by read(), only for their bounds
+            for (const Room& room : plan.named_rooms()) {
+                BoundsGrid bounds{plan.cells(), room.pos, room.pos};
+                QueueFill::fill<decltype(dialect)>(bounds, room.pos, [](const Pos&, int8_t) {}, [](const Pos&) {});
+                index.rooms.push_back({room.name, {bounds.first.x - 1, bounds.first.y - 1}, {bounds.last.x + 1, bounds.last.y + 1}});
+            }
+        });
+        return index;
+    }
+
+    // Load the sidecar of the plan, nothing when it is missing or out of date
+    static std::optional<LineIndex> load(const std::string& plan_path) {
+        std::ifstream in(sidecar(plan_path), std::ios::binary);
+        std::string magic(Magic.size(), '\0');
+        if (!in.read(magic.data(), magic.size()) || magic != Magic) {
+            return std::nullopt;
+        }
+        LineIndex index;
+        uint64_t size, mtime, ascii, count;
+        const auto read_string = [&in](std::string& str) {
+            uint64_t length;
+            if (!read_varint(in, length) || length > (1 << 20)) {
+                throw std::runtime_error("Invalid line index");
+            }
+            str.resize(length);
+            in.read(str.data(), length);
+        };
+        if (!read_varint(in, size) || !read_varint(in, mtime) || !read_varint(in, ascii)) {
+            throw std::runtime_error("Invalid line index");
+        }
+        index.ascii = ascii;
+        read_string(index.dialect);
+        index.stat(plan_path);
+        if (size != index.size || mtime != index.mtime) {
+            return std::nullopt;
+        }
+        if (!read_varint(in, count)) {
+            throw std::runtime_error("Invalid line index");
+        }
+        index.starts.resize(count);
+        for (uint64_t i = 0, start = 0, delta; i < count; ++i) {
+            if (!read_varint(in, delta)) {
+                throw std::runtime_error("Invalid line index");
+            }
+            index.starts[i] = (start += delta);
+        }
+        if (!read_varint(in, count)) {
+            throw std::runtime_error("Invalid line index");
+        }
+        index.rooms.resize(count);
+        for (auto& room : index.rooms) {
+            uint64_t box[4];
+            read_string(room.name);
+            for (auto& value : box) {
+                if (!read_varint(in, value)) {
+                    throw std::runtime_error("Invalid line index");
+                }
+            }
+            // stored shifted by one, the box around a room at the plan edge starts at -1
+            room.first = {static_cast<ssize_t>(box[0]) - 1, static_cast<ssize_t>(box[1]) - 1};
+            room.last = {static_cast<ssize_t>(box[2]) - 1, static_cast<ssize_t>(box[3]) - 1};
+        }
+        return index;
+    }
+
+    // Write the sidecar of the plan, replacing it atomically
+    void save(const std::string& plan_path) const {
+        const std::string path = sidecar(plan_path), temp = path + ".tmp";
+        {
+            std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+            out << Magic;
+            write_varint(out, size);
+            write_varint(out, mtime);
+            write_varint(out, ascii);
+            write_varint(out, dialect.size());
+            out << dialect;
+            write_varint(out, starts.size());
+            for (size_t i = 0; i < starts.size(); ++i) {
+                write_varint(out, starts[i] - (i > 0 ? starts[i - 1] : 0));
+            }
+            write_varint(out, rooms.size());
+            for (const auto& room : rooms) {
+                write_varint(out, room.name.size());
+                out << room.name;
+                for (const ssize_t value : {room.first.x, room.first.y, room.last.x, room.last.y}) {
+                    write_varint(out, value + 1);
+                }
+            }
+            if (!out.flush()) {
+                throw std::runtime_error("Can't write " + temp);
+            }
+        }
+        if (::rename(temp.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Can't write " + path + ": " + std::strerror(errno));
+        }
+    }
+
+    size_t lines() const {
+        return starts.size() - 1;
+    }
+
+    const RoomBox* find(const std::string& name) const {
+        const auto it = std::lower_bound(rooms.begin(), rooms.end(), name,
+            [](const RoomBox& room, const std::string& name) { return room.name < name; });
+        return it != rooms.end() && it->name == name ? &*it : nullptr;
+    }
+
+    // Read the cells of the region [first, last] of the plan file with pread,
+    // lines are cropped to the region columns
+    std::string read_region(const std::string& path, Pos first, Pos last) const {
+        first = {std::max<ssize_t>(first.x, 0), std::max<ssize_t>(first.y, 0)};
+        last.y = std::min<ssize_t>(last.y, lines() - 1);
+        std::string region;
+        if (first.y > last.y || first.x > last.x) {
+            return region;
+        }
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+        }
+        const auto pread_all = [&](std::string& data, uint64_t offset) {
+            for (size_t done = 0; done < data.size();) {
+                const ssize_t n = ::pread(fd, data.data() + done, data.size() - done, offset + done);
+                if (n <= 0 && !(n < 0 && errno == EINTR)) {
+                    ::close(fd);
+                    throw std::runtime_error("Can't read " + path + (n < 0 ? std::string(": ") + std::strerror(errno) : ""));
+                }
+                done += std::max<ssize_t>(n, 0);
+            }
+        };
+        if (ascii) {
+            // only the region bytes of each line
+            for (ssize_t y = first.y; y <= last.y; ++y) {
+                const uint64_t begin = std::min<uint64_t>(starts[y] + first.x, starts[y + 1]);
+                std::string line(std::min<uint64_t>(starts[y] + last.x + 1, starts[y + 1]) - begin, '\0');
+                pread_all(line, begin);
+                region += line.substr(0, line.find('\n'));
+                region += '\n';
+            }
+        } else {
+            // box-drawing characters take several bytes, read whole lines and crop the cells
+            std::string data(starts[last.y + 1] - starts[first.y], '\0');
+            pread_all(data, starts[first.y]);
+            std::istringstream in(data);
+            for (std::string line; std::getline(in, line);) {
+                transcode(line);
+                region += (static_cast<size_t>(first.x) < line.size() ? line.substr(first.x, last.x - first.x + 1) : "");
+                region += '\n';
+            }
+        }
+        ::close(fd);
+        return region;
+    }
+
+    // for tests
+    uint64_t file_size() const {
+        return size;
+    }
+private:
+    uint64_t size = 0;
+    uint64_t mtime = 0; // nanoseconds
+
+    // Grid of the room fill that keeps the bounds of the filled cells
+    struct BoundsGrid {
+        static constexpr bool tiled = false;
+        using Queue = DenseGrid::Queue;
+        DenseGrid& grid;
+        Pos first, last;
+
+        char get(const Pos& pos) const {
+            return grid.get(pos);
+        }
+
+        void set(const Pos& pos, char c) {
+            grid.set(pos, c);
+            first = {std::min(first.x, pos.x), std::min(first.y, pos.y)};
+            last = {std::max(last.x, pos.x), std::max(last.y, pos.y)};
+        }
+    };
+
+    void stat(const std::string& path) {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0) {
+            throw std::runtime_error("Can't stat " + path + ": " + std::strerror(errno));
+        }
+        size = st.st_size;
+        mtime = st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+    }
+};
+
+// Print the room named name with the rows of its bounding box read by the plan line index
+void process_indexed_room_query(const std::string& path, const LineIndex& index, const PlanOptions& options,
+        const std::string& name, std::ostream& out) {
+    const auto room = index.find(name);
+    if (!room) {
+        throw std::runtime_error("Unknown room " + name);
+    }
+    if (options.dialect != index.dialect) {
+        throw std::runtime_error("Line index of " + path + " is built for dialect " + index.dialect);
+    }
+    std::istringstream region(index.read_region(path, room->first, room->last));
+    process_room_query(region, options, name, out);
+}
+
+// Read a plan and print the route between the cells
+void process_route_query(std::istream& input, const PlanOptions& options, const Pos& from, const Pos& to, std::ostream& out) {
+    Plan plan;
+    plan.read(input);
+    with_dialect(options.dialect, [&](auto dialect) {
+        const auto route = RouteMap<decltype(dialect)>::build(plan.cells()).route(from, to);
+        if (!route) {
+            throw std::runtime_error("No route from " + from.str() + " to " + to.str());
+        }
+        out << "distance: " << route->distance << "\nroute:";
+        for (const Pos& pos : route->waypoints) {
+            out << ' ' << pos;
+        }
+        out << std::endl;
+    });
+}
+
+// Read a plan and simulate the delivery of its chairs
+void process_simulation(std::istream& input, const PlanOptions& options, const SimulationOptions& simulation, std::ostream& out) {
+    BasicPlan<DenseGrid, QueueFill, ChairPositions> plan;
+    plan.read(input);
+    with_dialect(options.dialect, [&](auto dialect) {
+        plan.template find_chairs_in_rooms<decltype(dialect)>();
+        simulate_delivery<decltype(dialect)>(plan.cells(), plan.chair_counter().chairs, simulation).print(out);
+    });
+}
+
+// Read a plan and print whether its chairs fit on the routes from the entrance
+void process_clearance(std::istream& input, const PlanOptions& options, const Pos& entrance, const ChairFootprints& footprints,
+        std::ostream& out) {
+    BasicPlan<DenseGrid, QueueFill, ChairPositions> plan;
+    plan.read(input);
+    with_dialect(options.dialect, [&](auto dialect) {
+        const Rooms rooms = plan.template find_chairs_in_rooms<decltype(dialect)>();
+        const auto& chairs = plan.chair_counter().chairs;
+        const auto fits = check_clearance<decltype(dialect)>(plan.cells(), chairs, entrance, footprints);
+        for (size_t i = 0; i < chairs.size(); ++i) {
+            out << ChairTypes[chairs[i].type] << " at " << chairs[i].pos << " in " << rooms[chairs[i].room].name << ": "
+                << (fits[i] ? "fits" : "doesn't fit") << '\n';
+        }
+    });
+}
+
+// Append data with a single write, so concurrent writers don't interleave records.
+// A new file is created with the header by linking a complete temporary file into
+// place, so concurrent writers never append before the header.
+void append_file(const std::string& filename, std::string_view header, std::string_view data) {
+    const auto write = [&filename](int fd, std::string_view data) {
+        for (size_t written = 0; written < data.size();) {
+            const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+            if (n < 0 && errno != EINTR) {
+                ::close(fd);
+                throw std::runtime_error("Can't write " + filename + ": " + std::strerror(errno));
+            }
+            written += std::max<ssize_t>(n, 0);
+        }
+    };
+    int fd = ::open(filename.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        static std::atomic<uint64_t> temps{0};
+        const std::string temp = filename + ".new." + std::to_string(::getpid()) + "." + std::to_string(temps++);
+        const int temp_fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (temp_fd < 0) {
+            throw std::runtime_error("Can't create " + temp + ": " + std::strerror(errno));
+        }
+        write(temp_fd, header);
+        ::close(temp_fd);
+        const bool linked = (::link(temp.c_str(), filename.c_str()) == 0 || errno == EEXIST); // or created by another writer
+        const int error = errno;
+        ::unlink(temp.c_str());
+        if (!linked) {
+            throw std::runtime_error("Can't create " + filename + ": " + std::strerror(error));
+        }
+        fd = ::open(filename.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        throw std::runtime_error("Can't open " + filename + ": " + std::strerror(errno));
+    }
+    write(fd, data);
+    ::close(fd);
+}
+
+// Workload capture file is the magic string followed by records of
+// varints timestamp (microseconds since epoch) and option flags,
+// then dialect and plan as varint length and bytes
+constexpr std::string_view CaptureMagic = "CHAIRCAP1\n";
+
+struct CaptureRecord {
+    uint64_t timestamp = 0;
+    PlanOptions options;
+    std::string plan;
+    bool memfd = false; // server request of a client accepting large outputs in a memfd
+
+    static constexpr uint64_t DoorsFlag = 1;
+    static constexpr uint64_t SparseFlag = 2;
+    static constexpr uint64_t MemfdFlag = 4;
+
+    void write(std::ostream& out) const {
+        write_varint(out, timestamp);
+        write_varint(out, (options.doors ? DoorsFlag : 0) | (options.sparse ? SparseFlag : 0) | (memfd ? MemfdFlag : 0));
+        write_varint(out, options.dialect.size());
+        out << options.dialect;
+        write_varint(out, plan.size());
+        out << plan;
+    }
+
+    // Returns false at the end of input
+    bool read(std::istream& in) {
+        if (!read_varint(in, timestamp)) {
+            return false;
+        }
+        uint64_t flags = 0;
+        if (!read_varint(in, flags)) {
+            throw std::runtime_error("Truncated capture record");
+        }
+        read_string(in, options.dialect);
+        read_string(in, plan);
+        options.doors = flags & DoorsFlag;
+        options.sparse = flags & SparseFlag;
+        memfd = flags & MemfdFlag;
+        return true;
+    }
+
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+private:
+    static void read_string(std::istream& in, std::string& str) {
+        uint64_t size = 0;
+        if (!read_varint(in, size)) {
+            throw std::runtime_error("Truncated capture record");
+        }
+        str.resize(size);
+        if (!in.read(str.data(), size)) {
+            throw std::runtime_error("Truncated capture record");
+        }
+    }
+};
+
+// Latency samples with nearest-rank percentiles
+class Latencies {
+private:
+    std::vector<std::chrono::nanoseconds> samples;
+    bool sorted = true;
+public:
+    void add(std::chrono::nanoseconds latency) {
+        samples.push_back(latency);
+        sorted = false;
+    }
+
+    size_t size() const {
+        return samples.size();
+    }
+
+    void add(const Latencies& other) {
+        samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+        sorted = false;
+    }
+
+    std::chrono::nanoseconds percentile(double p) {
+        if (samples.empty()) {
+            return {};
+        }
+        if (!sorted) {
+            std::sort(samples.begin(), samples.end());
+            sorted = true;
+        }
+        const size_t rank = static_cast<size_t>(std::ceil(p / 100 * samples.size()));
+        return samples[std::clamp<size_t>(rank, 1, samples.size()) - 1];
+    }
+
+    void print(std::ostream& os) {
+        const auto ms = [this](double p) { return percentile(p).count() / 1e6; };
+        os << "latency: p50: " << ms(50) << " ms, p90: " << ms(90) << " ms, p99: " << ms(99)
+            << " ms, p999: " << ms(99.9) << " ms, max: " << ms(100) << " ms\n";
+    }
+};
+
+// Re-execute the captured plans at original or maximum speed and report latencies
+void replay(const std::string& filename, bool max_speed, std::ostream& out) {
+    std::ifstream in(filename, std::ios::binary);
+    std::string magic(CaptureMagic.size(), '\0');
+    if (!in.read(magic.data(), magic.size()) || magic != CaptureMagic) {
+        throw std::runtime_error("Not a capture file " + filename);
+    }
+    Latencies latencies;
+    size_t errors = 0;
+    uint64_t first = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (CaptureRecord record; record.read(in);) {
+        if (!max_speed) {
+            first = (first ? first : record.timestamp);
+            std::this_thread::sleep_until(start + std::chrono::microseconds(record.timestamp - std::min(first, record.timestamp)));
+        }
+        const auto begin = std::chrono::steady_clock::now();
+        try {
+            std::istringstream input(record.plan);
+            std::ostringstream output;
+            process_plan(input, record.options, output);
+        } catch (const std::exception&) {
+            ++errors;
+        }
+        latencies.add(std::chrono::steady_clock::now() - begin);
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    out << "replay:\nplans: " << latencies.size() << ", errors: " << errors << ", time: " << elapsed.count() * 1000
+        << " ms, throughput: " << latencies.size() / elapsed.count() << " plans/s\n";
+    latencies.print(out);
+}
+
+// Unix socket protocol: frames of 32-bit little-endian payload length and payload.
+// Request payload is a CaptureRecord, response payload is a status byte and the output.
+// Outputs of at least MemfdThreshold bytes for clients accepting them are passed
+// as a sealed memfd attached to the frame with SCM_RIGHTS, and the payload is
+// only the ResponseMemfd status byte.
+enum : char { ResponseOk = 0, ResponseError = 1, ResponseMemfd = 2 };
+constexpr size_t MemfdThreshold = 64 * 1024;
+
+void write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        const ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Socket write error: ") + std::strerror(errno));
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+// Returns false on end of input before the first byte
+bool read_all(int fd, char* data, size_t size) {
+    for (size_t done = 0; done < size;) {
+        const ssize_t n = ::read(fd, data + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Socket read error: ") + std::strerror(errno));
+        }
+        if (n == 0) {
+            if (done == 0) {
+                return false;
+            }
+            throw std::runtime_error("Truncated frame");
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Write the frame, with the passed_fd file descriptor attached if any
+void write_frame(int fd, std::string_view payload, int passed_fd = -1) {
+    std::string frame(4, '\0');
+    for (int i = 0; i < 4; ++i) {
+        frame[i] = static_cast<char>(payload.size() >> (i * 8));
+    }
+    frame += payload;
+    size_t sent = 0;
+    if (passed_fd >= 0) {
+        // the descriptor goes with the first sent bytes
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        iovec iov{frame.data(), frame.size()};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
+        ssize_t n;
+        while ((n = ::sendmsg(fd, &message, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+        }
+        if (n < 0) {
+            throw std::runtime_error(std::string("Socket write error: ") + std::strerror(errno));
+        }
+        sent = n;
+    }
+    write_all(fd, frame.data() + sent, frame.size() - sent);
+}
+
+// Largest accepted frame payload, a larger length is a corrupt or hostile peer
+constexpr size_t MaxFrameSize = 256 << 20;
+
+// Returns false on end of input. A file descriptor passed with the frame is
+// stored to passed_fd, or closed without passed_fd.
+bool read_frame(int fd, std::string& payload, int* passed_fd = nullptr) {
+    uint8_t header[4];
+    size_t received = 0;
+    if (passed_fd) {
+        *passed_fd = -1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        iovec iov{header, sizeof(header)};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t n;
+        while ((n = ::recvmsg(fd, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+        }
+        if (n < 0) {
+            throw std::runtime_error(std::string("Socket read error: ") + std::strerror(errno));
+        } else if (n == 0) {
+            return false;
+        }
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+                std::memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        received = n;
+    }
+    if (received < sizeof(header) && !read_all(fd, reinterpret_cast<char*>(header) + received, sizeof(header) - received)) {
+        return false;
+    }
+    const uint32_t size = header[0] | header[1] << 8 | header[2] << 16 | static_cast<uint32_t>(header[3]) << 24;
+    if (size > MaxFrameSize) {
+        throw std::runtime_error("Frame too large " + std::to_string(size));
+    }
+    payload.resize(size);
+    if (!payload.empty() && !read_all(fd, payload.data(), payload.size())) {
+        throw std::runtime_error("Truncated frame");
+    }
+    return true;
+}
+
+sockaddr_un unix_address(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path is too long " + path);
+    }
+    path.copy(address.sun_path, path.size());
+    return address;
+}
+
+int listen_unix(const std::string& path) {
+    const sockaddr_un address = unix_address(path);
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ::unlink(path.c_str());
+    if (fd < 0 || ::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+            || ::listen(fd, SOMAXCONN) != 0) {
+        const std::string error = std::strerror(errno);
+        ::close(fd);
+        throw std::runtime_error("Can't listen on " + path + ": " + error);
+    }
+    return fd;
+}
+
+// Stream buffer of a response output. Outputs of MemfdThreshold bytes and more
+// are written to a memfd while they are produced, when memfd is set and memfds
+// are supported, and smaller ones are kept in memory. Write errors are thrown.
+class MemfdStreambuf : public std::streambuf {
+private:
+    std::string buffer;
+    int fd = -1;
+    bool memfd;
+
+    void write_buffer() {
+        for (const char* data = pbase(); data < pptr();) {
+            const ssize_t n = ::write(fd, data, pptr() - data);
+            if (n < 0 && errno != EINTR) {
+                throw std::runtime_error(std::string("Can't write memfd: ") + std::strerror(errno));
+            }
+            data += std::max<ssize_t>(n, 0);
+        }
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    // move the output to a new memfd, returns false if memfds are not supported
+    bool spill() {
+        if (fd < 0 && memfd) {
+            fd = ::memfd_create("chairs-output", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            memfd = (fd >= 0);
+        }
+        if (fd >= 0) {
+            write_buffer();
+        }
+        return fd >= 0;
+    }
+protected:
+    int_type overflow(int_type c) override {
+        if (!spill()) {
+            const size_t size = pptr() - pbase();
+            buffer.resize(buffer.size() * 2);
+            setp(buffer.data(), buffer.data() + buffer.size());
+            pbump(static_cast<int>(size));
+        }
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+public:
+    explicit MemfdStreambuf(bool memfd)
+        : buffer(MemfdThreshold, '\0')
+        , memfd(memfd)
+    {
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    ~MemfdStreambuf() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    MemfdStreambuf(const MemfdStreambuf&) = delete;
+    MemfdStreambuf& operator=(const MemfdStreambuf&) = delete;
+
+    // Memfd of the output, sealed against any change so the receiver can map
+    // it safely, or -1 for the output in memory
+    int seal() {
+        if (fd < 0 && (pptr() - pbase() < static_cast<ssize_t>(MemfdThreshold) || !spill())) {
+            return -1;
+        }
+        write_buffer();
+        if (::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+            throw std::runtime_error(std::string("Can't seal memfd: ") + std::strerror(errno));
+        }
+        return std::exchange(fd, -1);
+    }
+
+    // output kept in memory
+    std::string_view output() const {
+        return std::string_view(pbase(), pptr() - pbase());
+    }
+};
+
+// Long-running plan server on a Unix socket, a thread per connection
+class Server {
+private:
+    const std::string path;
+    const std::string record; // capture file for received plans
+    const int listener;
+    std::mutex mutex;
+    std::vector<int> connections;
+    std::vector<std::thread::id> finished; // connection threads to join
+    bool stopped = false;
+public:
+    explicit Server(const std::string& path, const std::string& record = {})
+        : path(path), record(record), listener(listen_unix(path))
+    {
+    }
+
+    ~Server() {
+        ::close(listener);
+        ::unlink(path.c_str());
+    }
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    // Serve connections until stop() or interrupt(), each one by its own thread,
+    // and join the threads. Finished threads are joined on every new connection.
+    void run() {
+        std::vector<std::thread> threads;
+        const auto join = [&threads](std::thread::id id) {
+            const auto thread = std::find_if(threads.begin(), threads.end(), [id](const std::thread& thread) { return thread.get_id() == id; });
+            thread->join();
+            threads.erase(thread);
+        };
+        for (;;) {
+            const int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                break;
+            }
+            std::vector<std::thread::id> joined;
+            {
+                std::lock_guard lock(mutex);
+                if (stopped) {
+                    ::close(fd);
+                    break;
+                }
+                connections.push_back(fd);
+                threads.emplace_back(&Server::serve, this, fd);
+                joined.swap(finished);
+            }
+            std::for_each(joined.begin(), joined.end(), join);
+        }
+        stop();
+        for (auto& thread : threads) {
+            thread.join(); // after its metrics shard is retired
+        }
+    }
+
+    // Stop accepting connections, safe in a signal handler. run() then stops
+    // the open connections
+    void interrupt() {
+        ::shutdown(listener, SHUT_RDWR);
+    }
+
+    void stop() {
+        std::lock_guard lock(mutex);
+        stopped = true;
+        ::shutdown(listener, SHUT_RDWR);
+        for (int fd : connections) {
+            ::shutdown(fd, SHUT_RD);
+        }
+    }
+private:
+    void serve(int fd) {
+        try {
+            MetricsShard& metrics = Metrics::local();
+            int memfd = -1; // of the response
+            for (std::string payload; read_frame(fd, payload);) {
+                MetricsShard::add(metrics.in_flight, 1);
+                std::string response(1, ResponseOk);
+                try {
+                    std::istringstream request(payload);
+                    CaptureRecord plan;
+                    plan.read(request);
+                    if (!record.empty()) {
+                        plan.timestamp = CaptureRecord::now();
+                        plan.memfd = false;
+                        std::ostringstream data;
+                        plan.write(data);
+                        append_file(record, CaptureMagic, data.str());
+                    }
+                    std::istringstream input(plan.plan);
+                    MemfdStreambuf buffer(plan.memfd);
+                    std::ostream output(&buffer);
+                    output.exceptions(std::ios::badbit);
+                    process_plan(input, plan.options, output);
+                    memfd = buffer.seal();
+                    if (memfd >= 0) {
+                        response[0] = ResponseMemfd;
+                    } else {
+                        response += buffer.output();
+                    }
+                } catch (const std::exception& ex) {
+                    response = std::string(1, ResponseError) + ex.what();
+                }
+                MetricsShard::add(metrics.in_flight, -1);
+                try {
+                    write_frame(fd, response, memfd);
+                } catch (...) {
+                    ::close(memfd);
+                    throw;
+                }
+                ::close(memfd);
+                memfd = -1;
+            }
+        } catch (const std::exception& ex) {
+            std::cerr << "Connection error: " << ex.what() << std::endl;
+        }
+        std::lock_guard lock(mutex);
+        connections.erase(std::find(connections.begin(), connections.end(), fd));
+        ::close(fd);
+        finished.push_back(std::this_thread::get_id());
+    }
+};
+
+// Server stopped by SIGINT and SIGTERM
+Server* signal_server = nullptr;
+
+void interrupt_server(int) {
+    if (signal_server) {
+        signal_server->interrupt();
+    }
+}
+
+// Prometheus metrics endpoint, answers any HTTP request on a Unix socket
+class MetricsEndpoint {
+private:
+    const std::string path;
+    const int listener;
+public:
+    explicit MetricsEndpoint(const std::string& path)
+        : path(path), listener(listen_unix(path))
+    {
+    }
+
+    ~MetricsEndpoint() {
+        ::close(listener);
+        ::unlink(path.c_str());
+    }
+
+    MetricsEndpoint(const MetricsEndpoint&) = delete;
+    MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+
+    // Serve scrapes until stop()
+    void run() {
+        for (;;) {
+            const int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                break;
+            }
+            try {
+                std::string request;
+                char buffer[1024];
+                while (request.find("\r\n\r\n") == std::string::npos && request.size() < 16 * 1024) {
+                    const ssize_t n = ::read(fd, buffer, sizeof(buffer));
+                    if (n <= 0) {
+                        break;
+                    }
+                    request.append(buffer, n);
+                }
+                const std::string body = Metrics::exposition();
+                const std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                    + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+                write_all(fd, response.data(), response.size());
+            } catch (const std::exception& ex) {
+                std::cerr << "Metrics error: " << ex.what() << std::endl;
+            }
+            ::close(fd);
+        }
+    }
+
+    void stop() {
+        ::shutdown(listener, SHUT_RDWR);
+    }
+};
+
+// Plan processing output of a server response, inline or mapped read-only from a memfd
+class Response {
+private:
+    std::string inline_output;
+    void* mapped = nullptr;
+    size_t size = 0;
+public:
+    explicit Response(std::string output)
+        : inline_output(std::move(output))
+    {
+    }
+
+    // Map the memfd, it must be sealed against shrinking and writes
+    explicit Response(int memfd) {
+        struct stat st;
+        const int seals = ::fcntl(memfd, F_GET_SEALS);
+        if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE) || ::fstat(memfd, &st) != 0) {
+            throw std::runtime_error("Response memfd is not sealed");
+        }
+        size = st.st_size;
+        if (size > 0) {
+            mapped = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, memfd, 0);
+            if (mapped == MAP_FAILED) {
+                mapped = nullptr;
+                throw std::runtime_error(std::string("Can't map response: ") + std::strerror(errno));
+            }
+        }
+    }
+
+    ~Response() {
+        if (mapped) {
+            ::munmap(mapped, size);
+        }
+    }
+
+    Response(Response&& other)
+        : inline_output(std::move(other.inline_output))
+        , mapped(std::exchange(other.mapped, nullptr))
+        , size(other.size)
+    {
+    }
+
+    Response(const Response&) = delete;
+    Response& operator=(const Response&) = delete;
+    Response& operator=(Response&&) = delete;
+
+    std::string_view output() const {
+        return mapped ? std::string_view(static_cast<const char*>(mapped), size) : std::string_view(inline_output);
+    }
+
+    bool is_mapped() const {
+        return mapped != nullptr;
+    }
+};
+
+// Plan server client
+class Client {
+private:
+    int fd = -1;
+public:
+    explicit Client(const std::string& path) {
+        const sockaddr_un address = unix_address(path);
+        fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+            const std::string error = std::strerror(errno);
+            ::close(fd);
+            throw std::runtime_error("Can't connect to " + path + ": " + error);
+        }
+    }
+
+    ~Client() {
+        ::close(fd);
+    }
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    // Returns the plan processing output, throws on error response.
+    // Large outputs are mapped from the memfd passed by the server without copying.
+    Response query(const PlanOptions& options, const std::string& plan) {
+        std::ostringstream data;
+        CaptureRecord{CaptureRecord::now(), options, plan, true}.write(data);
+        write_frame(fd, data.str());
+        std::string response;
+        int memfd = -1;
+        const bool received = read_frame(fd, response, &memfd);
+        if (memfd >= 0) {
+            const auto close = [memfd] { ::close(memfd); };
+            try {
+                if (received && response.size() == 1 && response[0] == ResponseMemfd) {
+                    Response mapped(memfd);
+                    close();
+                    return mapped;
+                }
+            } catch (...) {
+                close();
+                throw;
+            }
+            close();
+        }
+        if (!received || response.empty()) {
+            throw std::runtime_error("Connection closed by server");
+        }
+        if (response[0] != ResponseOk) {
+            throw std::runtime_error(response.substr(1));
+        }
+        return Response(response.substr(1));
+    }
+
+    std::string request(const PlanOptions& options, const std::string& plan) {
+        return std::string(query(options, plan).output());
+    }
+};
+
+struct LoadOptions {
+    std::string path;
+    size_t connections = 1;
+    double rate = 0; // plans per second for open loop, 0 for closed loop
+    double duration = 5; // seconds
+    PlanOptions plan;
+};
+
+struct LoadResult {
+    size_t errors = 0;
+    double seconds = 0;
+    Latencies latencies;
+
+    void print(const LoadOptions& options, std::ostream& out) {
+        out << "loadgen:\nmode: " << (options.rate > 0 ? "open" : "closed") << " loop, connections: " << options.connections
+            << ", requests: " << latencies.size() << ", errors: " << errors << ", time: " << seconds << " s, throughput: "
+            << latencies.size() / seconds << " plans/s\n";
+        latencies.print(out);
+    }
+};
+
+// Send corpus plans to the server over several connections, in closed loop
+// or in open loop at a fixed arrival rate. Open loop latencies are measured
+// from the intended send time to correct the coordinated omission.
+LoadResult load_test(const LoadOptions& options, const std::vector<std::string>& corpus) {
+    if (corpus.empty() || options.connections == 0) {
+        throw std::runtime_error("Load test needs a corpus and connections");
+    }
+    std::vector<LoadResult> results(options.connections);
+    // connect before starting, a connection error is reported to the caller
+    std::vector<std::unique_ptr<Client>> clients;
+    for (size_t k = 0; k < options.connections; ++k) {
+        clients.push_back(std::make_unique<Client>(options.path));
+    }
+    std::vector<std::thread> threads;
+    const auto start = std::chrono::steady_clock::now();
+    const auto end = start + std::chrono::duration<double>(options.duration);
+    const std::chrono::duration<double> interval(options.rate > 0 ? options.connections / options.rate : 0);
+    for (size_t k = 0; k < options.connections; ++k) {
+        threads.emplace_back([&, k] {
+            Client& client = *clients[k];
+            LoadResult& result = results[k];
+            for (size_t i = 0;; ++i) {
+                auto intended = std::chrono::steady_clock::now();
+                if (options.rate > 0) {
+                    intended = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval * (i + k / double(options.connections)));
+                    std::this_thread::sleep_until(intended);
+                }
+                if (intended >= end) {
+                    break;
+                }
+                try {
+                    client.query(options.plan, corpus[(k + i * options.connections) % corpus.size()]);
+                } catch (const std::exception&) {
+                    ++result.errors;
+                }
+                result.latencies.add(std::chrono::steady_clock::now() - intended);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    LoadResult total;
+    total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (const auto& result : results) {
+        total.errors += result.errors;
+        total.latencies.add(result.latencies);
+    }
+    return total;
+}
+
+// Batch result record. The plan total has an empty room name, and the batch
+// total has empty plan and room names, so totals are sorted before rooms.
+struct Result {
+    std::string plan;
+    std::string room;
+    ChairCount chairs{};
+
+    bool operator<(const Result& other) const {
+        return std::tie(this->plan, this->room) < std::tie(other.plan, other.room);
+    }
+
+    // for tests
+    bool operator==(const Result& other) const {
+        return this->plan == other.plan && this->room == other.room && this->chairs == other.chairs;
+    }
+    friend std::ostream& operator<<(std::ostream& os, const Result& result) {
+        return os << result.plan << '\t' << result.room << '\t' << Room{result.room, {}, result.chairs}.chairs_str();
+    }
+};
+using Results = std::vector<Result>;
+
+ChairCount parse_chairs(const std::string& str) {
+    ChairCount chairs{};
+    std::istringstream in(str);
+    for (size_t i = 0; i < chairs.size(); ++i) {
+        char type = 0, colon = 0, comma = ',';
+        if (i > 0) {
+            in >> comma;
+        }
+        if (!(in >> type >> colon >> chairs[i]) || type != ChairTypes[i] || colon != ':' || comma != ',') {
+            throw std::runtime_error("Invalid chair counts " + str);
+        }
+    }
+    return chairs;
+}
+
+// Returns false at the end of input
+bool read_result(std::istream& in, Result& result) {
+    std::string line;
+    if (!std::getline(in, line)) {
+        return false;
+    }
+    const size_t plan_end = line.find('\t'), room_end = line.find('\t', plan_end + 1);
+    if (room_end == std::string::npos) {
+        throw std::runtime_error("Invalid result line " + line);
+    }
+    result.plan = line.substr(0, plan_end);
+    result.room = line.substr(plan_end + 1, room_end - plan_end - 1);
+    result.chairs = parse_chairs(line.substr(room_end + 1));
+    return true;
+}
+
+// Result streams in text, CSV with a header line, or binary format with a magic
+enum class ResultFormat { Text, Csv, Binary };
+
+ResultFormat result_format(const std::string& name) {
+    if (name == "text") {
+        return ResultFormat::Text;
+    } else if (name == "csv") {
+        return ResultFormat::Csv;
+    } else if (name == "binary") {
+        return ResultFormat::Binary;
+    }
+    throw std::runtime_error("Unknown result format " + name);
+}
+
+constexpr std::string_view ResultsMagic = "CHAIRRES1\n";
+constexpr std::string_view CsvHeader = "plan,room,W,P,S,C";
+
+// CSV field quoted when necessary
+std::string csv_field(const std::string& field) {
+    if (field.find_first_of(",\"\r\n") == std::string::npos) {
+        return field;
+    }
+    std::string quoted = "\"";
+    for (char c : field) {
+        quoted += (c == '"' ? "\"\"" : std::string(1, c));
+    }
+    return quoted + '"';
+}
+
+class ResultWriter {
+private:
+    std::ostream& out;
+    const ResultFormat format;
+
+    void write_string(const std::string& str) {
+        write_varint(out, str.size());
+        out.write(str.data(), str.size());
+    }
+public:
+    ResultWriter(std::ostream& out, ResultFormat format)
+        : out(out)
+        , format(format)
+    {
+        if (format == ResultFormat::Csv) {
+            out << CsvHeader << '\n';
+        } else if (format == ResultFormat::Binary) {
+            out << ResultsMagic;
+        }
+    }
+
+    void write(const Result& result) {
+        switch (format) {
+        case ResultFormat::Text:
+            out << result << '\n';
+            break;
+        case ResultFormat::Csv:
+            out << csv_field(result.plan) << ',' << csv_field(result.room);
+            for (size_t count : result.chairs) {
+                out << ',' << count;
+            }
+            out << '\n';
+            break;
+        case ResultFormat::Binary:
+            write_string(result.plan);
+            write_string(result.room);
+            for (size_t count : result.chairs) {
+                write_varint(out, count);
+            }
+            break;
+        }
+    }
+};
+
+// Text results are lines of tab separated plan, room and chair counts
+void write_results(std::ostream& out, const Results& results, ResultFormat format = ResultFormat::Text) {
+    ResultWriter writer(out, format);
+    for (const auto& result : results) {
+        writer.write(result);
+    }
+}
+
+// Reader of a result stream with the format detected from its beginning
+class ResultReader {
+private:
+    std::istream& in;
+    ResultFormat format = ResultFormat::Text;
+    std::optional<std::string> first_line; // of text format
+
+    std::string read_string() {
+        uint64_t size;
+        if (!read_varint(in, size)) {
+            throw std::runtime_error("Truncated binary result");
+        }
+        std::string str(size, '\0');
+        if (!in.read(str.data(), size)) {
+            throw std::runtime_error("Truncated binary result");
+        }
+        return str;
+    }
+
+    static std::vector<std::string> split_csv(const std::string& line) {
+        std::vector<std::string> fields(1);
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); ++i) {
+            const char c = line[i];
+            if (quoted && c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                fields.back() += c;
+                ++i;
+            } else if (c == '"') {
+                quoted = !quoted;
+            } else if (c == ',' && !quoted) {
+                fields.emplace_back();
+            } else {
+                fields.back() += c;
+            }
+        }
+        if (quoted) {
+            throw std::runtime_error("Unterminated quoted CSV field in " + line);
+        }
+        return fields;
+    }
+public:
+    explicit ResultReader(std::istream& in)
+        : in(in)
+    {
+        // the binary magic is a line too
+        std::string line;
+        if (!std::getline(in, line)) {
+            return;
+        }
+        if (line + '\n' == ResultsMagic) {
+            format = ResultFormat::Binary;
+        } else if (line == CsvHeader || line == std::string(CsvHeader) + '\r') {
+            format = ResultFormat::Csv;
+        } else {
+            first_line = line;
+        }
+    }
+
+    // Returns false at the end of input
+    bool read(Result& result) {
+        switch (format) {
+        case ResultFormat::Text:
+            if (first_line) {
+                std::istringstream line(*first_line);
+                first_line.reset();
+                return read_result(line, result);
+            }
+            return read_result(in, result);
+        case ResultFormat::Csv: {
+            std::string line;
+            if (!std::getline(in, line)) {
+                return false;
+            }
+            // a quoted field may hold line breaks, the record ends with balanced quotes
+            for (std::string next; std::count(line.begin(), line.end(), '"') % 2 != 0;) {
+                if (!std::getline(in, next)) {
+                    throw std::runtime_error("Unterminated quoted CSV field in " + line);
+                }
+                line += '\n' + next;
+            }
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            const auto fields = split_csv(line);
+            if (fields.size() != 2 + result.chairs.size()) {
+                throw std::runtime_error("Invalid CSV result line " + line);
+            }
+            result.plan = fields[0];
+            result.room = fields[1];
+            for (size_t i = 0; i < result.chairs.size(); ++i) {
+                result.chairs[i] = std::stoul(fields[2 + i]);
+            }
+            return true;
+        }
+        case ResultFormat::Binary:
+            if (in.peek() == std::char_traits<char>::eof()) {
+                return false;
+            }
+            result.plan = read_string();
+            result.room = read_string();
+            for (size_t& count : result.chairs) {
+                uint64_t value;
+                if (!read_varint(in, value)) {
+                    throw std::runtime_error("Truncated binary result");
+                }
+                count = value;
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+// K-way merge of sorted result streams, summing chair counts of equal plan and room.
+// Keeps only the current result of each input in memory.
+void merge_results(const std::vector<std::istream*>& inputs, ResultWriter& writer) {
+    std::vector<ResultReader> readers;
+    readers.reserve(inputs.size());
+    for (std::istream* in : inputs) {
+        readers.emplace_back(*in);
+    }
+    using Head = std::pair<Result, size_t>; // current result and its input index
+    const auto greater = [](const Head& a, const Head& b) {
+        return b.first < a.first || (!(a.first < b.first) && a.second > b.second);
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(greater)> heads(greater);
+    for (size_t i = 0; i < readers.size(); ++i) {
+        Result result;
+        if (readers[i].read(result)) {
+            heads.emplace(std::move(result), i);
+        }
+    }
+    std::optional<Result> merged;
+    while (!heads.empty()) {
+        auto [result, index] = heads.top();
+        heads.pop();
+        Result next;
+        if (readers[index].read(next)) {
+            if (next < result) {
+                throw std::runtime_error("Unsorted results in input " + std::to_string(index + 1) + " at " + next.plan + '\t' + next.room);
+            }
+            heads.emplace(std::move(next), index);
+        }
+        if (merged && !(*merged < result)) {
+            for (size_t i = 0; i < result.chairs.size(); ++i) {
+                merged->chairs[i] += result.chairs[i];
+            }
+        } else {
+            if (merged) {
+                writer.write(*merged);
+            }
+            merged = std::move(result);
+        }
+    }
+    if (merged) {
+        writer.write(*merged);
+    }
+}
+
+struct BatchOptions {
+    std::string manifest; // plan files list, one per line
+    std::string shard_dir; // directory for shard leases and results of several workers
+    size_t shard_size = 100; // plans per shard
+    double lease = 60; // seconds without renewal before a shard lease expires
+    std::string record; // capture file to record processed plans
+    std::string checkpoint; // checkpoint file of completed plans
+    bool resume = false; // skip completed plans of the checkpoint
+    ResultFormat format = ResultFormat::Text; // of the results output
+    PlanOptions plan;
+};
+
+std::vector<std::string> read_manifest(const std::string& filename) {
+    std::ifstream in(filename);
+    if (!in) {
+        throw std::runtime_error("Can't read manifest " + filename);
+    }
+    std::vector<std::string> plans;
+    for (std::string line; std::getline(in, line);) {
+        if (!trim(line).empty()) {
+            plans.push_back(line);
+        }
+    }
+    return plans;
+}
+
+// Add the batch total of the plan totals, and sort results
+void add_batch_total(Results& results) {
+    PhaseScope sort(Phase::Sort);
+    Result total;
+    for (const auto& result : results) {
+        if (!result.plan.empty() && result.room.empty()) {
+            for (size_t i = 0; i < total.chairs.size(); ++i) {
+                total.chairs[i] += result.chairs[i];
+            }
+        }
+    }
+    results.push_back(total);
+    std::sort(results.begin(), results.end());
+}
+
+// Analyze a batch plan, errors are returned in error
+Results analyze_batch_plan(const std::string& path, const BatchOptions& options, std::string& error) {
+    Results plan_results;
+    try {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Can't read plan");
+        }
+        std::istream* input = &file;
+        std::optional<GzipIstream> gzip;
+        if (is_gzip(file)) {
+            input = &gzip.emplace(file);
+        }
+        // plan is read into memory only to record it
+        std::istringstream recorded;
+        if (!options.record.empty()) {
+            std::string plan{std::istreambuf_iterator<char>(*input), {}};
+            std::ostringstream data;
+            CaptureRecord{CaptureRecord::now(), options.plan, plan}.write(data);
+            append_file(options.record, CaptureMagic, data.str());
+            recorded.str(std::move(plan));
+            input = &recorded;
+        }
+        analyze_plan(*input, options.plan, [&](const Rooms& rooms, const Doors&) {
+            for (const Room& room : rooms) {
+                plan_results.push_back(Result{path, &room == &rooms.front() ? "" : room.name, room.chairs});
+            }
+        });
+    } catch (const std::exception& ex) {
+        error = path + ": " + ex.what();
+        plan_results.clear();
+    }
+    return plan_results;
+}
+
+// Analyze the plans and return their sorted results with the batch total.
+// Failed plans are reported to errors, and passed to done with empty results.
+// Plans are analyzed by the shared pool tasks, and done is called in the completion order.
+Results analyze_batch(std::vector<std::string>::const_iterator begin, std::vector<std::string>::const_iterator end,
+        const BatchOptions& options, std::ostream& errors,
+        const std::function<void(const std::string& plan, const Results& results)>& done = {}) {
+    // results of each plan, in the manifest order
+    std::vector<Results> plan_results(end - begin);
+    std::mutex mutex; // of errors and done
+    // Each task reads its plan itself, so the grid is allocated on the node of the worker
+    TaskGroup group;
+    for (size_t i = 0; i < plan_results.size(); ++i) {
+        group.run([&, i] {
+            std::string error;
+            plan_results[i] = analyze_batch_plan(begin[i], options, error);
+            std::lock_guard lock(mutex);
+            if (!error.empty()) {
+                errors << error << std::endl;
+            }
+            if (done) {
+                done(begin[i], plan_results[i]);
+            }
+        });
+    }
+    group.wait();
+    Results results;
+    for (const auto& plan : plan_results) {
+        results.insert(results.end(), plan.begin(), plan.end());
+    }
+    add_batch_total(results);
+    return results;
+}
+
+// Append-only checkpoint of the completed plans with their results.
+// The header holds the plan options, a resume with other options is refused.
+// Entries are buffered and appended in batches ended by a commit line,
+// only committed entries are restored on resume.
+class Checkpoint {
+private:
+    static constexpr std::string_view Magic = "CHAIRCKPT1\n";
+    static constexpr std::string_view Commit = "#commit\n";
+    static constexpr size_t BatchPlans = 64;
+    static constexpr auto BatchTime = std::chrono::seconds(1);
+
+    const std::string path;
+    int fd = -1;
+    std::string buffer;
+    size_t pending = 0; // plans in buffer
+    std::chrono::steady_clock::time_point last_flush = std::chrono::steady_clock::now();
+    Results restored;
+    std::vector<std::string> completed; // sorted
+public:
+    // Open the checkpoint, restore its committed entries on resume, or start it over
+    Checkpoint(const std::string& path, bool resume, const PlanOptions& options)
+        : path(path)
+    {
+        const std::string header = std::string(Magic) + "#options\tdialect=" + options.dialect
+            + "\tdoors=" + (options.doors ? "1" : "0") + "\tsparse=" + (options.sparse ? "1" : "0") + '\n';
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Can't open checkpoint " + path + ": " + std::strerror(errno));
+        }
+        off_t committed = 0;
+        if (resume) {
+            std::ifstream in(path, std::ios::binary);
+            const std::string data{std::istreambuf_iterator<char>(in), {}};
+            if (!data.empty() && data.rfind(Magic, 0) != 0) {
+                ::close(fd);
+                throw std::runtime_error("Not a checkpoint file " + path);
+            } else if (!data.empty() && data.rfind(header, 0) != 0) {
+                ::close(fd);
+                throw std::runtime_error("Checkpoint " + path + " has other plan options: "
+                    + data.substr(Magic.size(), data.find('\n', Magic.size()) - Magic.size()));
+            }
+            Results results;
+            std::vector<std::string> plans;
+            for (size_t pos = header.size(), end; pos < data.size() && (end = data.find('\n', pos)) != std::string::npos; pos = end + 1) {
+                const std::string line = data.substr(pos, end - pos);
+                if (line + '\n' == Commit) {
+                    restored.insert(restored.end(), results.begin(), results.end());
+                    completed.insert(completed.end(), plans.begin(), plans.end());
+                    results.clear();
+                    plans.clear();
+                    committed = end + 1;
+                } else if (line.rfind("#done\t", 0) == 0) {
+                    plans.push_back(line.substr(line.find('\t') + 1));
+                } else {
+                    std::istringstream input(line);
+                    read_result(input, results.emplace_back());
+                }
+            }
+            std::sort(completed.begin(), completed.end());
+        }
+        // drop a torn tail of the crashed run
+        if (::ftruncate(fd, committed) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Can't truncate checkpoint " + path + ": " + std::strerror(errno));
+        }
+        if (committed == 0) {
+            buffer = header;
+        }
+    }
+
+    ~Checkpoint() {
+        try {
+            flush();
+        } catch (const std::exception& ex) {
+            std::cerr << ex.what() << std::endl;
+        }
+        ::close(fd);
+    }
+
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint& operator=(const Checkpoint&) = delete;
+
+    // results of the completed plans
+    const Results& results() const {
+        return restored;
+    }
+
+    bool is_completed(const std::string& plan) const {
+        return std::binary_search(completed.begin(), completed.end(), plan);
+    }
+
+    // Add completed plan results, flushed in batches
+    void add(const std::string& plan, const Results& results) {
+        for (const auto& result : results) {
+            std::ostringstream line;
+            line << result << '\n';
+            buffer += line.str();
+        }
+        buffer += "#done\t" + plan + '\n';
+        if (++pending >= BatchPlans || std::chrono::steady_clock::now() - last_flush >= BatchTime) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (pending == 0 && buffer.empty()) {
+            return;
+        }
+        buffer += Commit;
+        for (size_t written = 0; written < buffer.size();) {
+            const ssize_t n = ::write(fd, buffer.data() + written, buffer.size() - written);
+            if (n < 0 && errno != EINTR) {
+                throw std::runtime_error("Can't write checkpoint " + path + ": " + std::strerror(errno));
+            }
+            written += std::max<ssize_t>(n, 0);
+        }
+        if (::fdatasync(fd) != 0) {
+            throw std::runtime_error("Can't sync checkpoint " + path + ": " + std::strerror(errno));
+        }
+        buffer.clear();
+        pending = 0;
+        last_flush = std::chrono::steady_clock::now();
+    }
+};
+
+// Analyze the manifest plans and print sorted results, with optional checkpoint and resume
+void run_batch(const BatchOptions& options, std::ostream& out, std::ostream& errors) {
+    auto plans = read_manifest(options.manifest);
+    if (options.checkpoint.empty()) {
+        write_results(out, analyze_batch(plans.begin(), plans.end(), options, errors), options.format);
+        return;
+    }
+    Checkpoint checkpoint(options.checkpoint, options.resume, options.plan);
+    plans.erase(std::remove_if(plans.begin(), plans.end(),
+        [&checkpoint](const std::string& plan) { return checkpoint.is_completed(plan); }), plans.end());
+    Results results = analyze_batch(plans.begin(), plans.end(), options, errors,
+        [&checkpoint](const std::string& plan, const Results& results) {
+            if (!results.empty()) {
+                checkpoint.add(plan, results);
+            }
+        });
+    checkpoint.flush();
+    results.erase(results.begin()); // batch total
+    results.insert(results.end(), checkpoint.results().begin(), checkpoint.results().end());
+    add_batch_total(results);
+    write_results(out, results, options.format);
+}
+
+// Reads the owner and the modification time of a lease file,
+// returns false when there is no lease
+bool read_lease(const std::string& path, std::string& owner, timespec& mtime) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    char buffer[256];
+    const ssize_t size = ::fstat(fd, &st) == 0 ? ::read(fd, buffer, sizeof(buffer)) : -1;
+    ::close(fd);
+    if (size < 0) {
+        return false;
+    }
+    owner.assign(buffer, size);
+    mtime = st.st_mtim;
+    return true;
+}
+
+// Shard lease is a lock file created exclusively by the worker, and renewed
+// by updating its modification time. An expired lease of a crashed worker is
+// taken over by renaming it aside, and checking that the moved file is still
+// the expired lease, so only one of the competing workers wins.
+// A shard may still be processed twice when a lease expires while its owner
+// is alive, shard results are written atomically, so this is harmless.
+class Lease {
+private:
+    std::string path;
+    std::string owner;
+    bool owned = false;
+public:
+    Lease(const std::string& path, double ttl, const std::string& owner)
+        : path(path), owner(owner)
+    {
+        for (int attempt = 0; attempt < 2 && !owned; ++attempt) {
+            const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd >= 0) {
+                owned = ::write(fd, owner.data(), owner.size()) == static_cast<ssize_t>(owner.size());
+                ::close(fd);
+                if (!owned) {
+                    ::unlink(path.c_str());
+                }
+                break;
+            } else if (errno != EEXIST) {
+                break;
+            }
+            std::string holder;
+            timespec mtime;
+            if (!read_lease(path, holder, mtime)) {
+                continue; // released meanwhile
+            }
+            const double age = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count()
+                - (mtime.tv_sec + mtime.tv_nsec / 1e9);
+            const std::string stale = path + ".stale." + owner;
+            if (age < ttl || ::rename(path.c_str(), stale.c_str()) != 0) {
+                break;
+            }
+            // another worker may have taken over or renewed the lease between
+            // the check and the rename, then put its lease back
+            std::string moved_holder;
+            timespec moved_mtime;
+            if (!read_lease(stale, moved_holder, moved_mtime) || moved_holder != holder
+                || moved_mtime.tv_sec != mtime.tv_sec || moved_mtime.tv_nsec != mtime.tv_nsec) {
+                ::link(stale.c_str(), path.c_str());
+                ::unlink(stale.c_str());
+                break;
+            }
+            ::unlink(stale.c_str());
+        }
+    }
+
+    ~Lease() {
+        std::string holder;
+        timespec mtime;
+        if (owned && read_lease(path, holder, mtime) && holder == owner) {
+            ::unlink(path.c_str());
+        }
+    }
+
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+
+    explicit operator bool() const {
+        return owned;
+    }
+
+    void renew() {
+        ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    }
+};
+
+bool file_exists(const std::string& path) {
+    return ::access(path.c_str(), F_OK) == 0;
+}
+
+// Claim and process manifest shards until all of them have results,
+// returns number of shards processed by this worker
+size_t run_batch_worker(const BatchOptions& options, std::ostream& errors) {
+    const auto plans = read_manifest(options.manifest);
+    const size_t shards = (plans.size() + options.shard_size - 1) / options.shard_size;
+    char host[256] = {};
+    ::gethostname(host, sizeof(host) - 1);
+    const std::string owner = std::string(host) + "." + std::to_string(::getpid());
+    ::mkdir(options.shard_dir.c_str(), 0755);
+
+    size_t processed = 0;
+    for (bool done = false; !done;) {
+        done = true;
+        for (size_t shard = 0; shard < shards; ++shard) {
+            const std::string name = options.shard_dir + "/shard-" + std::to_string(shard);
+            if (file_exists(name + ".txt")) {
+                continue;
+            }
+            Lease lease(name + ".lease", options.lease, owner);
+            if (!lease) {
+                done = false; // claimed by another worker
+                continue;
+            } else if (file_exists(name + ".txt")) {
+                continue;
+            }
+            const auto begin = plans.begin() + shard * options.shard_size;
+            const auto end = plans.begin() + std::min(plans.size(), (shard + 1) * options.shard_size);
+            const Results results = analyze_batch(begin, end, options, errors,
+                [&lease](const std::string&, const Results&) { lease.renew(); });
+
+            // write results atomically
+            const std::string temp = name + ".txt." + owner;
+            {
+                std::ofstream out(temp);
+                write_results(out, results);
+                if (!out.flush()) {
+                    throw std::runtime_error("Can't write " + temp);
+                }
+            }
+            if (::rename(temp.c_str(), (name + ".txt").c_str()) != 0) {
+                throw std::runtime_error("Can't rename " + temp + ": " + std::strerror(errno));
+            }
+            ++processed;
+        }
+        if (!done) {
+            // wait for the other workers or for their leases to expire
+            std::this_thread::sleep_for(std::chrono::duration<double>(std::min(1.0, options.lease / 4)));
+        }
+    }
+    return processed;
+}
+
+// testdata/rooms.txt
+constexpr auto RoomsPlan = R"(
++-----------+------------------------------------+
+|           |                                    |
+| (closet)  |                                    |
+|         P |                            S       |
+|         P |         (sleeping room)            |
+|         P |                                    |
+|           |                                    |
++-----------+    W                               |
+|           |                                    |
+|        W  |                                    |
+|           |                                    |
+|           +--------------+---------------------+
+|                          |                     |
+|                          |                W W  |
+|                          |    (office)         |
+|                          |                     |
++--------------+           |                     |
+|              |           |                     |
+| (toilet)     |           |             P       |
+|   C          |           |                     |
+|              |           |                     |
++--------------+           +---------------------+
+|              |           |                     |
+|              |           |                     |
+|              |           |                     |
+| (bathroom)   |           |      (kitchen)      |
+|              |           |                     |
+|              |           |      W   W          |
+|              |           |      W   W          |
+|       P      +           |                     |
+|             /            +---------------------+
+|            /                                   |
+|           /                                    |
+|          /                          W    W   W |
++---------+                                      |
+|                                                |
+| S                                   W    W   W |
+|                (living room)                   |
+| S                                              |
+|                                                |
+|                                                |
+|                                                |
+|                                                |
++--------------------------+---------------------+
+                           |                     |
+                           |                  P  |
+                           |  (balcony)          |
+                           |                 P   |
+                           |                     |
+                           +---------------------+
+)";
+
+// testdata/rooms.txt analyzed at compile time
+constexpr auto RoomsLayout = static_plan<std::string_view(RoomsPlan).size()>(RoomsPlan);
+static_assert(RoomsLayout.room_count == 1 + 8 && RoomsLayout.total().chairs[0] == 14 && RoomsLayout.total().chairs[1] == 7
+    && RoomsLayout.total().chairs[2] == 3 && RoomsLayout.total().chairs[3] == 1);
+static_assert(RoomsLayout.find("living room")->chairs[0] == 7 && RoomsLayout.find("living room")->chairs[2] == 2);
+static_assert(RoomsLayout.find("toilet")->chairs[3] == 1 && RoomsLayout.find("garage") == nullptr);
+static_assert(RoomsLayout.room_at(Pos{3, 3}) == RoomsLayout.find("closet") && RoomsLayout.room_at(Pos{0, 1}) == nullptr);
+
+// Run test(plan) for an instance of each shipped plan type
+template<typename Test>
+bool for_plan_types(Test&& test) {
+    return std::apply([&test](auto... plans) { return (test(plans) & ...); }, PlanTypes{});
+}
+
+// Unique path in /tmp for a test file, directory or socket, removed with its line index when done
+struct TempFile {
+    std::string path;
+    explicit TempFile(const std::string& name) {
+        static std::atomic<size_t> count{0};
+        path = "/tmp/chairs-planner-test-" + std::to_string(::getpid()) + "-" + std::to_string(count++) + "-" + name;
+    }
+    TempFile(const std::string& name, const std::string& data) : TempFile(name) {
+        std::ofstream(path, std::ios::binary) << data;
+    }
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+    ~TempFile() {
+        std::error_code error;
+        std::filesystem::remove_all(path, error);
+        std::filesystem::remove(LineIndex::sidecar(path), error);
+    }
+};
+
+bool test_runner() {
+    // run tests with the options, output and results of the nested run are returned
+    const auto run_with = [](const TestOptions& options, std::initializer_list<TestCase> tests, std::string& output) {
+        const TestOptions saved = test_options;
+        std::ostream* const parent = test_output;
+        std::ostringstream out;
+        test_options = options;
+        test_output = &out;
+        const bool ok = run(tests, "|");
+        test_options = saved;
+        test_output = parent;
+        output = out.str();
+        return ok;
+    };
+    const auto cases = {
+        TestCase{"repeat", [&]{
+            size_t leaf = 0, group = 0;
+            std::string output;
+            TestOptions options;
+            options.repeat = 3;
+            const bool ok = run_with(options, {
+                TestCase{"leaf", [&leaf]{ return ++leaf > 0; } },
+                TestCase{"group", [&group]{ ++group; return run({ TestCase{"nested", []{ return true; } } }, "/"); } },
+            }, output);
+            return ok && leaf == 3 && group == 1 && output == "|leaf:  OK|group: /nested:  OK\n OK\n";
+        } },
+        TestCase{"budget", [&]{
+            std::string output;
+            TestOptions options;
+            options.budget = 1e-3;
+            const bool ok = run_with(options, {
+                TestCase{"fast", []{ return true; } },
+                TestCase{"slow", []{ std::this_thread::sleep_for(std::chrono::milliseconds(5)); return true; } },
+                TestCase{"own budget", []{ std::this_thread::sleep_for(std::chrono::milliseconds(5)); return true; }, 1.0 },
+            }, output);
+            return !ok && output.find("|fast:  OK|slow:  OK SLOW (") == 0 && output.find("|own budget:  OK\n") != std::string::npos;
+        } },
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_compiled_plan() {
+    const auto cases = {
+        TestCase{"rooms.txt", []{
+            Plan plan;
+            std::istringstream input(RoomsPlan);
+            plan.read(input);
+            const Rooms rooms = plan.find_chairs_in_rooms();
+            const CompiledPlan compiled(rooms);
+            bool ok = compiled.size() == rooms.size() && compiled.name(0) == "total" && !compiled.find("total");
+            for (size_t id = 1; id < rooms.size(); ++id) {
+                ok = ok && compiled.find(rooms[id].name) == id && compiled.chair_count(id) == rooms[id].chairs;
+            }
+            return ok && !compiled.find("garage") && !compiled.find("") && !compiled.find("living");
+        } },
+        TestCase{"no rooms", []{
+            const CompiledPlan compiled(Rooms{ Room{"total"} });
+            return !compiled.find("total") && !compiled.find("a");
+        } },
+        TestCase{"100k rooms", []{
+            Rooms rooms{ Room{"total"} };
+            for (size_t i = 0; i < 100000; ++i) {
+                rooms.emplace_back("room " + std::to_string(i * 7919 % 1000003));
+            }
+            const CompiledPlan compiled(rooms);
+            bool ok = true;
+            for (size_t id = 1; id < rooms.size(); ++id) {
+                ok = ok && compiled.find(rooms[id].name) == id;
+            }
+            return ok && !compiled.find("room 1000003");
+        }, 2.0 },
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_route() {
+    // breadth first search on the whole plan, distance and cluster borders crossed by the shortest path
+    const auto bfs = [](auto dialect, const DenseGrid& grid, const Pos& from, const Pos& to) -> std::optional<std::pair<size_t, size_t>> {
+        using Dialect = decltype(dialect);
+        const ssize_t width = grid.width(), height = grid.height();
+        const auto open = [&](const Pos& pos) {
+            return 0 <= pos.x && pos.x < width && 0 <= pos.y && pos.y < height && cell_class<Dialect>(grid.get(pos)) != WallCell;
+        };
+        if (!open(from) || !open(to)) {
+            return std::nullopt;
+        }
+        std::vector<size_t> distance(width * height, SIZE_MAX);
+        std::vector<Pos> parent(width * height);
+        std::queue<Pos> q;
+        distance[from.y * width + from.x] = 0;
+        q.push(from);
+        while (!q.empty()) {
+            const Pos pos = q.front();
+            q.pop();
+            if (pos == to) {
+                size_t borders = 0;
+                const ssize_t size = RouteMap<Dialect>::ClusterSize;
+                for (Pos p = to; !(p == from); p = parent[p.y * width + p.x]) {
+                    const Pos& prev = parent[p.y * width + p.x];
+                    borders += (p.x / size != prev.x / size) + (p.y / size != prev.y / size);
+                }
+                return std::pair{distance[pos.y * width + pos.x], borders};
+            }
+            for (const auto& [dx, dy] : Dialect::neighbors) {
+                const Pos next{pos.x + dx, pos.y + dy};
+                if (dx != 0 && dy != 0 && !open({next.x, pos.y}) && !open({pos.x, next.y})) {
+                    continue; // squeezing between walls
+                }
+                if (open(next) && distance[next.y * width + next.x] == SIZE_MAX) {
+                    distance[next.y * width + next.x] = distance[pos.y * width + pos.x] + 1;
+                    parent[next.y * width + next.x] = pos;
+                    q.push(next);
+                }
+            }
+        }
+        return std::nullopt;
+    };
+    // routes between pseudo random cells compared with the full search, within the bound of RouteMap
+    const auto compare = [&bfs](auto dialect, const std::string& data, size_t queries) {
+        using Dialect = decltype(dialect);
+        const size_t detour = RouteMap<Dialect>::EntranceSpacing + (std::size(Dialect::neighbors) > 4);
+        Plan plan;
+        std::istringstream input(data);
+        plan.read(input);
+        const auto map = RouteMap<Dialect>::build(plan.cells());
+        const ssize_t width = plan.cells().width(), height = plan.cells().height();
+        uint32_t random = 1;
+        const auto next = [&random](ssize_t limit) { return static_cast<ssize_t>(((random = random * 1103515245 + 12345) >> 8) % limit); };
+        for (size_t i = 0; i < queries; ++i) {
+            const Pos from{next(width), next(height)}, to{next(width), next(height)};
+            const auto route = map.route(from, to);
+            const auto expected = bfs(dialect, plan.cells(), from, to);
+            if (route.has_value() != expected.has_value()
+                    || (route && (route->distance < expected->first || route->distance > expected->first + expected->second * detour
+                        || !(route->waypoints.front() == from) || !(route->waypoints.back() == to)))) {
+                std::cerr << Dialect::name << " " << from << " -> " << to << ": " << (route ? std::to_string(route->distance) : "none")
+                    << " != " << (expected ? std::to_string(expected->first) : "none") << "\n";
+                return false;
+            }
+        }
+        return true;
+    };
+    // walls with gaps every few cells, spanning many clusters, and diagonal walls for the 8-connected dialect
+    const auto maze = [](size_t width, size_t height, bool diagonal) {
+        std::string maze;
+        for (size_t y = 0; y < height; ++y) {
+            std::string line(width, ' ');
+            for (size_t x = 0; x < line.size(); ++x) {
+                if ((y % 7 == 0 && (x * 13 + y) % 11 != 0) || (x % 9 == 0 && (y * 7 + x) % 5 != 0)) {
+                    line[x] = (y % 7 == 0 ? '-' : '|');
+                } else if (diagonal && (x + y) % 12 == 0 && (x * 3 + y) % 17 != 0) {
+                    line[x] = '/';
+                }
+            }
+            maze += line + '\n';
+        }
+        return maze;
+    };
+    const auto cases = {
+        TestCase{"same cluster", []{
+            std::istringstream input("+-----+\n|  |  |\n|     |\n+-----+\n");
+            Plan plan;
+            plan.read(input);
+            const auto map = RouteMap<>::build(plan.cells());
+            const auto route = map.route({1, 1}, {4, 1});
+            return map.node_count() == 0 && route && route->distance == 5 && !map.route({1, 1}, {0, 0}) && map.route({1, 1}, {1, 1})->distance == 0;
+        } },
+        TestCase{"diagonal", []{
+            std::istringstream input("+-----+\n|  |  |\n|     |\n+-----+\n");
+            Plan plan;
+            plan.read(input);
+            const auto map = RouteMap<Diagonal>::build(plan.cells());
+            const auto route = map.route({1, 1}, {4, 1});
+            // a diagonal step squeezing between two walls is blocked
+            const auto squeeze = [](const std::string& data) {
+                std::istringstream input(data);
+                Plan plan;
+                plan.read(input);
+                return RouteMap<Diagonal>::build(plan.cells()).route({0, 0}, {1, 1});
+            };
+            return route && route->distance == 3 && !squeeze(" |\n- \n") && squeeze("  \n- \n")->distance == 1;
+        } },
+        TestCase{"rooms.txt", [&]{
+            return compare(Classic{}, RoomsPlan, 2000) && compare(Diagonal{}, RoomsPlan, 2000);
+        } },
+        TestCase{"maze", [&]{
+            return compare(Classic{}, maze(300, 200, false), 500);
+        } },
+        TestCase{"diagonal maze", [&]{
+            return compare(Diagonal{}, maze(300, 200, true), 500);
+        } },
+        TestCase{"query time", [&]{
+            // the map is built before the timed queries
+            Plan plan;
+            std::istringstream input(maze(1000, 1000, false));
+            plan.read(input);
+            const auto map = RouteMap<>::build(plan.cells());
+            return run({TestCase{"1000 queries", [&map]{
+                uint32_t random = 1;
+                const auto next = [&random](ssize_t limit) { return static_cast<ssize_t>(((random = random * 1103515245 + 12345) >> 8) % limit); };
+                size_t routes = 0;
+                for (size_t i = 0; i < 1000; ++i) {
+                    routes += map.route({next(1000), next(1000)}, {next(1000), next(1000)}).has_value();
+                }
+                return routes > 0;
+            }, 1.0 }}, "\n    ");
+        } },
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_simulation() {
+    const auto simulate = [](const std::string& data, const SimulationOptions& options) {
+        BasicPlan<DenseGrid, QueueFill, ChairPositions> plan;
+        std::istringstream input(data);
+        plan.read(input);
+        plan.find_chairs_in_rooms();
+        return simulate_delivery(plan.cells(), plan.chair_counter().chairs, options);
+    };
+    SimulationOptions corridor;
+    corridor.entrance = {1, 1};
+    corridor.workers = 1;
+    const auto cases = {
+        TestCase{"single chair", [&]{
+            // 4 cells with the chair at 1.5 s per cell, 4 cells back
+            const auto result = simulate("+------+\n|(a) W |\n+------+\n", corridor);
+            return result.chairs == 1 && result.time == 10 && result.narrow_cells == 5 && result.workers[0].waiting == 0;
+        } },
+        TestCase{"narrow passage", [&]{
+            SimulationOptions options = corridor;
+            options.workers = 2;
+            const auto result = simulate("+------+\n|(a) WW|\n+------+\n", options);
+            return result.chairs == 2 && result.workers[1].waiting == 1.5 && result.workers[0].chairs == 1;
+        } },
+        TestCase{"crew", [&]{
+            // wide hall, the crew isn't slowed down
+            std::string hall = "+" + std::string(40, '-') + "+\n";
+            for (size_t y = 0; y < 20; ++y) {
+                hall += "|" + std::string(40, y % 4 == 3 ? 'S' : ' ') + "|\n";
+            }
+            hall += "+" + std::string(40, '-') + "+\n";
+            hall.replace(hall.find("| "), 4, "|(a)");
+            SimulationOptions options = corridor;
+            const auto one = simulate(hall, options);
+            options.workers = 4;
+            const auto four = simulate(hall, options);
+            return one.chairs == 200 && four.chairs == 200 && four.time < one.time / 3 && four.workers[0].waiting == 0;
+        } },
+        TestCase{"unreachable", [&]{
+            const auto result = simulate("+------+\n|(a) W |\n+------+\n|(b) P |\n+------+\n", corridor);
+            return result.chairs == 1 && result.unreachable == 1;
+        } },
+        TestCase{"building", [&]{
+            // grid of rooms with doors to corridors
+            std::string building;
+            for (size_t y = 0; y < 400; ++y) {
+                std::string line(400, ' ');
+                for (size_t x = 0; x < line.size(); ++x) {
+                    if (y % 20 == 0 || x % 20 == 0) {
+                        line[x] = ((x % 20 == 10 || y % 20 == 10) ? 'D' : '+');
+                    } else if ((x * 7 + y * 3) % 31 == 0) {
+                        line[x] = ChairTypes[(x + y) % ChairTypes.size()];
+                    }
+                }
+                if (y % 20 == 1) {
+                    for (size_t x = 1; x < line.size(); x += 20) {
+                        const std::string name = "(" + std::to_string(x / 20) + "," + std::to_string(y / 20) + ")";
+                        line.replace(x, name.size(), name);
+                    }
+                }
+                building += line + '\n';
+            }
+            SimulationOptions options = corridor;
+            options.entrance = {2, 2};
+            options.workers = 10;
+            const auto result = simulate(building, options);
+            return result.chairs > 1000 && result.unreachable == 0;
+        }, 1.0 },
+        TestCase{"dialect", [&]{
+            // a diagonal route is shorter, the hatching is a wall only in the classic dialect
+            const auto simulate = [&](const std::string& data, const std::string& dialect) {
+                std::istringstream input(data);
+                std::ostringstream out;
+                PlanOptions options;
+                options.dialect = dialect;
+                process_simulation(input, options, corridor, out);
+                return out.str();
+            };
+            const std::string hall = "+-----+\n|(a)  |\n|     |\n|    W|\n+-----+\n";
+            const std::string hatched = "+-----+\n|(a)  |\n|/////|\n|    W|\n+-----+\n";
+            return simulate(hall, "classic").find("time: 15 s\n") != std::string::npos
+                && simulate(hall, "diagonal").find("time: 10 s\n") != std::string::npos
+                && simulate(hatched, "classic").rfind("chairs: 0,", 0) == 0
+                && simulate(hatched, "hatched").rfind("chairs: 1,", 0) == 0;
+        } },
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_clearance() {
+    const auto check = [](const std::string& data, const Pos& entrance) {
+        BasicPlan<DenseGrid, QueueFill, ChairPositions> plan;
+        std::istringstream input(data);
+        plan.read(input);
+        plan.find_chairs_in_rooms();
+        return check_clearance(plan.cells(), plan.chair_counter().chairs, entrance);
+    };
+    // a sofa in the hall behind a passage of the given width
+    const auto hall = [](size_t passage) {
+        std::string plan = "+-----------+\n|(a)        |\n";
+        for (size_t y = 0; y < 3; ++y) {
+            plan += "|" + std::string(5, ' ') + (y < passage ? ' ' : '|') + std::string(5, ' ') + "|\n";
+        }
+        return plan + "|        S  |\n|           |\n+-----------+\n";
+    };
+    const auto cases = {
+        TestCase{"values", []{
+            std::istringstream input("+-----+\n|     |\n|     |\n|     |\n+-----+\n");
+            Plan plan;
+            plan.read(input);
+            const ClearanceMap map(plan.cells());
+            return map.at({0, 0}) == 0 && map.at({1, 1}) == 1 && map.at({3, 2}) == 2 && map.at({3, 3}) == 1
+                && map.at({-1, 0}) == 0;
+        } },
+        TestCase{"narrow passage", [&]{
+            const auto fits = check(hall(1), {2, 3});
+            return fits.size() == 1 && !fits[0];
+        } },
+        TestCase{"wide passage", [&]{
+            const auto fits = check(hall(3), {2, 3});
+            return fits.size() == 1 && fits[0];
+        } },
+        TestCase{"small chairs", [&]{
+            const auto fits = check("+-----+\n|(a) W|\n+--+--+\n|(b) P|\n+-----+\n", {1, 1});
+            return fits == std::vector<bool>{true, false};
+        } },
+        TestCase{"rooms.txt", [&]{
+            std::istringstream input(RoomsPlan);
+            BasicPlan<DenseGrid, QueueFill, ChairPositions> plan;
+            plan.read(input);
+            const Rooms rooms = plan.find_chairs_in_rooms();
+            const auto& chairs = plan.chair_counter().chairs;
+            const auto fits = check_clearance(plan.cells(), chairs, {20, 41});
+            for (size_t i = 0; i < chairs.size(); ++i) {
+                if (fits[i] != (rooms[chairs[i].room].name == "living room")) {
+                    return false;
+                }
+            }
+            return !chairs.empty();
+        } },
+        TestCase{"dialect", []{
+            // `/` hatching is a wall between the chair and the entrance only in the classic dialect
+            const auto clearance = [](const std::string& dialect) {
+                std::istringstream input("+-----+\n|(a) W|\n|/////|\n|     |\n+-----+\n");
+                std::ostringstream out;
+                PlanOptions options;
+                options.dialect = dialect;
+                process_clearance(input, options, {2, 3}, DefaultFootprints, out);
+                return out.str();
+            };
+            return clearance("classic").find(": doesn't fit\n") != std::string::npos
+                && clearance("hatched").find(": fits\n") != std::string::npos;
+        } },
+        TestCase{"wall entrance", [&]{
+            try {
+                check("+-----+\n|(a) W|\n+-----+\n", {0, 0});
+                return false;
+            } catch (const std::runtime_error&) {
+                return true;
+            }
+        } },
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_line_index() {
+    const auto query = [](const std::string& data, const std::string& name) {
+        std::istringstream input(data);
+        std::ostringstream out;
+        process_room_query(input, PlanOptions{}, name, out);
+        return out.str();
+    };
+    const auto cases = {
+        TestCase{"newlines", []{
+            std::string data(1000, 'x');
+            std::vector<uint64_t> expected, starts;
+            for (size_t i = 0; i < data.size(); i += 1 + i % 37) {
+                data[i] = '\n';
+                expected.push_back(100 + i + 1);
+            }
+            find_newlines(data.data(), data.size(), 100, starts);
+            return starts == expected;
+        } },
+        TestCase{"rooms.txt", [&query]{
+            const std::string data = RoomsPlan;
+            const TempFile temp("rooms.txt", data);
+            const std::string& path = temp.path;
+            LineIndex::build(path, PlanOptions{}).save(path);
+            const auto index = LineIndex::load(path);
+            bool ok = index && index->lines() == 51 && index->rooms.size() == 8 && index->ascii;
+            for (const auto& room : index ? index->rooms : std::vector<LineIndex::RoomBox>{}) {
+                std::ostringstream out;
+                process_indexed_room_query(path, *index, PlanOptions{}, room.name, out);
+                ok = ok && out.str() == query(data, room.name);
+            }
+            return ok;
+        } },
+        TestCase{"region", []{
+            const TempFile temp("region.txt", "+---+---+\n|(a)|(b)|\n| W | P |\n+---+---+");
+            const std::string& path = temp.path;
+            const auto index = LineIndex::build(path, PlanOptions{});
+            return index.lines() == 4 && index.read_region(path, {4, 1}, {7, 3}) == "|(b)\n| P \n+---\n"
+                && index.read_region(path, {-2, 3}, {1, 10}) == "+-\n" && index.find("b")->first == Pos{4, 0};
+        } },
+        TestCase{"box drawing", [&query]{
+            const std::string data = "┌───┬───┐\n│(a)│(b)│\n│ W │ P │\n└───┴───┘\n";
+            const TempFile temp("box.txt", data);
+            const std::string& path = temp.path;
+            const auto index = LineIndex::build(path, PlanOptions{});
+            std::ostringstream out;
+            process_indexed_room_query(path, index, PlanOptions{}, "b", out);
+            return !index.ascii && index.read_region(path, {4, 1}, {8, 2}) == "|(b)|\n| P |\n" && out.str() == query(data, "b");
+        } },
+        TestCase{"out of date", []{
+            const TempFile temp("stale.txt", "+---+\n|(a)|\n+---+\n");
+            const std::string& path = temp.path;
+            LineIndex::build(path, PlanOptions{}).save(path);
+            const bool loaded = LineIndex::load(path).has_value();
+            std::ofstream(path, std::ios::binary | std::ios::app) << "|(b)|\n+---+\n";
+            return loaded && !LineIndex::load(path);
+        } },
+        TestCase{"huge plan", [&query]{
+            // grid of 2500 rooms, a room query reads its rows only
+            std::string data;
+            for (size_t y = 0; y <= 1000; ++y) {
+                std::string line(1001, ' ');
+                for (size_t x = 0; x < line.size(); ++x) {
+                    line[x] = (y % 20 == 0 || x % 20 == 0 ? '+' : (x + y) % 7 == 0 ? 'W' : ' ');
+                }
+                for (size_t x = 1; y % 20 == 1 && x < line.size(); x += 20) {
+                    const std::string name = "(" + std::to_string(x / 20) + "," + std::to_string(y / 20) + ")";
+                    line.replace(x, name.size(), name);
+                }
+                data += line + '\n';
+            }
+            const TempFile temp("huge.txt", data);
+            const std::string& path = temp.path;
+            const auto index = LineIndex::build(path, PlanOptions{});
+            const auto room = index.find("17,33");
+            std::ostringstream out;
+            process_indexed_room_query(path, index, PlanOptions{}, "17,33", out);
+            return index.rooms.size() == 2500 && room && room->first == Pos{340, 660} && room->last == Pos{360, 680}
+                && index.read_region(path, room->first, room->last).size() < data.size() / 1000
+                && out.str() == query(data, "17,33");
+        }, 2.0 },
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_thread_pool() {
+    const auto cases = {
+        TestCase{"tasks", []{
+            ThreadPool pool("test", PoolOptions{4});
+            std::atomic<size_t> sum{0};
+            TaskGroup group(pool);
+            for (size_t i = 1; i <= 1000; ++i) {
+                group.run([&sum, i] { sum += i; });
+            }
+            group.wait();
+            const auto stats = pool.stats();
+            return sum == 500500 && pool.size() == 4 && stats.tasks == 1000
+                && stats.utilization() >= 0 && stats.utilization() <= 1;
+        } },
+        TestCase{"nested", []{
+            // every worker waits for nested groups, the waiting threads run the queued tasks
+            ThreadPool pool("test", PoolOptions{2});
+            std::function<size_t(size_t, size_t)> count = [&](size_t first, size_t last) -> size_t {
+                if (last - first <= 16) {
+                    return last - first;
+                }
+                size_t left = 0, right = 0;
+                TaskGroup group(pool);
+                group.run([&] { left = count(first, (first + last) / 2); });
+                group.run([&] { right = count((first + last) / 2, last); });
+                group.wait();
+                return left + right;
+            };
+            return count(0, 100000) == 100000;
+        } },
+        TestCase{"priorities", []{
+            // without workers the caller runs the tasks by priority, each one in the submission order
+            ThreadPool pool("test", PoolOptions{1});
+            std::string order;
+            TaskGroup group(pool);
+            group.run([&order] { order += 'l'; }, TaskPriority::Low);
+            group.run([&order] { order += 'n'; });
+            group.run([&order] { order += 'h'; }, TaskPriority::High);
+            group.run([&order] { order += 'N'; });
+            group.wait();
+            return order == "hnNl";
+        } },
+        TestCase{"nested wait", []{
+            // a waiting task runs its own subtask, not the newer task of another group
+            ThreadPool pool("test", PoolOptions{1});
+            std::string order;
+            TaskGroup group(pool);
+            group.run([&] {
+                TaskGroup nested(pool);
+                nested.run([&order] { order += 's'; });
+                group.run([&order] { order += 'b'; });
+                order += 'a';
+                nested.wait();
+                order += 'A';
+            });
+            group.wait();
+            return order == "asAb";
+        } },
+        TestCase{"exception", []{
+            ThreadPool pool("test", PoolOptions{2});
+            TaskGroup group(pool);
+            std::atomic<size_t> done{0};
+            for (size_t i = 0; i < 10; ++i) {
+                group.run([&done, i] {
+                    if (i == 5) {
+                        throw std::runtime_error("task failed");
+                    }
+                    ++done;
+                });
+            }
+            try {
+                group.wait();
+            } catch (const std::runtime_error& ex) {
+                return done == 9 && std::string(ex.what()) == "task failed";
+            }
+            return false;
+        } },
+        TestCase{"stats", []{
+            ThreadPool pool("stats test", PoolOptions{1});
+            const auto stats = ThreadPool::all_stats();
+            return std::any_of(stats.begin(), stats.end(), [](const ThreadPool::Stats& stats) { return stats.name == "stats test"; });
+        } },
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_trim() {
+    auto test = [](std::string str, std::string expected) {
+            return TestCase{str, [=]{ return trim(str) == expected; } };
+    };
+    const auto cases = {
+        test("", ""),
+        test("    ", ""),
+        test(" aa bb c", "aa bb c"),
+        test("aaa    bbb cc    ", "aaa    bbb cc"),
+        test("   a   bb    ccc     ", "a   bb    ccc"),
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_is_wall() {
+    auto test = [](std::string str, bool expected = true) {
+            return TestCase{str, [=]{ return std::all_of(str.begin(), str.end(), is_wall) == expected; } };
+    };
+    const auto cases = {
+        test("+----+"),
+        test("|/\\"),
+        test(" \t   cc", false),
+        test(" Q asdf P R S W", false),
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_transcode() {
+    auto test = [](std::string str, std::string expected) {
+            return TestCase{str, [=]{ std::string line = str; transcode(line); return line == expected; } };
+    };
+    const auto cases = {
+        test("", ""),
+        test("+--+ (room) |/\\|", "+--+ (room) |/\\|"),
+        test("┌──┬──┐", "+--+--+"),
+        test("│ (café) W ╱ ╲ │", "| (café) W / \\ |"),
+        test("║ ══╬══ ║", "| --+-- |"),
+        test("│ long ASCII run to cross the vector width │ and another one here │", "| long ASCII run to cross the vector width | and another one here |"),
+        test("truncated \xE2\x94", "truncated \xE2\x94"),
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_gzip() {
+#if defined(CHAIRS_WITH_ZLIB)
+    const auto compress = [](const std::string& data) {
+        z_stream stream{};
+        ::deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        std::string compressed(::deflateBound(&stream, data.size()), '\0');
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        stream.avail_in = data.size();
+        stream.next_out = reinterpret_cast<Bytef*>(compressed.data());
+        stream.avail_out = compressed.size();
+        ::deflate(&stream, Z_FINISH);
+        compressed.resize(stream.total_out);
+        ::deflateEnd(&stream);
+        return compressed;
+    };
+    const auto decompress = [](const std::string& data) {
+        std::istringstream source(data);
+        GzipIstream input(source);
+        return is_gzip(source) && std::string{std::istreambuf_iterator<char>(input), {}} == RoomsPlan;
+    };
+    const auto cases = {
+        TestCase{"plain", []{
+            std::istringstream plain(RoomsPlan);
+            return !is_gzip(plain);
+        } },
+        TestCase{"decompress", [&]{
+            return decompress(compress(RoomsPlan));
+        } },
+        TestCase{"members", [&]{
+            const std::string plan = RoomsPlan;
+            return decompress(compress(plan.substr(0, 1000)) + compress(plan.substr(1000)));
+        } },
+        TestCase{"plan", [&]{
+            std::istringstream source(compress(RoomsPlan)), plain(RoomsPlan);
+            GzipIstream input(source);
+            Plan plan, expected;
+            plan.read(input);
+            expected.read(plain);
+            return plan.find_chairs_in_rooms() == expected.find_chairs_in_rooms();
+        } },
+        TestCase{"trailing data", [&]{
+            std::istringstream source(compress(RoomsPlan) + "trailing\n");
+            GzipIstream input(source);
+            try {
+                Plan plan;
+                plan.read(input);
+            } catch (const std::runtime_error& ex) {
+                return std::string(ex.what()) == "Trailing data after gzip data";
+            }
+            return false;
+        } },
+        TestCase{"truncated", [&]{
+            const std::string compressed = compress(RoomsPlan);
+            std::istringstream source(compressed.substr(0, compressed.size() / 2));
+            GzipIstream input(source);
+            try {
+                Plan plan;
+                plan.read(input);
+            } catch (const std::runtime_error&) {
+                return true;
+            }
+            return false;
+        } },
+    };
+#else
+    const auto cases = {
+        TestCase{"not supported", []{
+            std::istringstream source("\x1F\x8B");
+            try {
+                GzipIstream input(source);
+            } catch (const std::runtime_error&) {
+                return is_gzip(source);
+            }
+            return false;
+        } },
+    };
+#endif
+    return run(cases, "\n  ");
+}
+
+bool test_compact_plan() {
+    const auto compact = [](const std::string& plan) {
+        std::istringstream in(plan);
+        std::ostringstream out;
+        convert_plan(in, out, true);
+        return out.str();
+    };
+    const auto cases = {
+        TestCase{"round trip", [&]{
+            std::istringstream in(compact(RoomsPlan));
+            std::ostringstream out;
+            convert_plan(in, out, false);
+            return out.str() == RoomsPlan;
+        } },
+        TestCase{"runs", [&]{
+            std::istringstream in(compact("+----------+\n|   ab     |\n|   ac     |\n\n"));
+            const bool detected = is_compact_plan(in);
+            CompactPlanReader reader(in);
+            std::string lines[5];
+            return detected
+                && reader.next_line(lines[0]) && reader.next_line(lines[1]) && reader.next_line(lines[2])
+                && reader.next_line(lines[3]) && !reader.next_line(lines[4])
+                && lines[0] == "+----------+" && lines[1] == "|   ab     |" && lines[2] == "|   ac     |" && lines[3].empty();
+        } },
+        TestCase{"size", [&]{
+            return compact(RoomsPlan).size() * 3 < std::string(RoomsPlan).size();
+        } },
+        TestCase{"plan", [&]{
+            std::istringstream data(compact(RoomsPlan)), text(RoomsPlan);
+            Plan plan, expected;
+            plan.read(data);
+            expected.read(text);
+            return plan.find_chairs_in_rooms() == expected.find_chairs_in_rooms();
+        } },
+        TestCase{"truncated", [&]{
+            const std::string data = compact(RoomsPlan);
+            std::istringstream in(data.substr(0, data.size() - 5));
+            try {
+                Plan plan;
+                plan.read(in);
+            } catch (const std::runtime_error&) {
+                return true;
+            }
+            return false;
+        } },
+        TestCase{"row size", [&]{
+            // a corrupt row size fails before allocating the row
+            std::stringstream data;
+            data << CompactPlanMagic;
+            write_varint(data, ~0ull);
+            try {
+                std::string line;
+                CompactPlanReader(data).next_line(line);
+            } catch (const std::runtime_error& ex) {
+                return std::string(ex.what()) == "Invalid compact plan";
+            }
+            return false;
+        } },
+    };
+    return run(cases, "\n  ");
+}
+
+bool test_char_type() {
+    auto test = [](char chair, int type) {
+            return TestCase{std::string{"chair "} + chair, [=]{ return chair_type(chair) == type; } };
+    };
+    const auto cases = {
+        test('A', -1),
+        test('-', -1),
+        test('|', -1),
+        test(' ', -1),
+        test('W', 0),
+        test('P', 1),
+        test('S', 2),
+        test('C', 3),
+    };
+    return run(cases, "\n  ");
+}
+
+template<typename PlanType>
+bool test_dialect() {
+    const auto test = [](std::string name, auto dialect, std::string data, ChairCount expected) {
+        return TestCase{name + " " + dialect.name, [=] {
+            PlanType plan;
+            std::istringstream input(data);
+            plan.read(input);
+            return plan.template find_chairs_in_rooms<decltype(dialect)>().at(1).chairs == expected;
+        }};
+    };
+    const auto hatch =
+        "+--------+\n"
+        "|(a)  /  |\n"
+        "|    / W |\n"
+        "+--------+\n";
+    const auto no_corners =
+        " -----\n"
+        "|(a)  |\n"
+        "|  W  |\n"
+        " -----\n"
+        "P   C\n";
+    const auto cases = {
+        test("hatch", Classic{}, hatch, { 0, 0, 0, 0 }),
+        test("hatch", Diagonal{}, hatch, { 0, 0, 0, 0 }),
+        test("hatch", Hatched{}, hatch, { 1, 0, 0, 0 }),
+        test("no corners", Classic{}, no_corners, { 1, 0, 0, 0 }),
+        test("no corners", Diagonal{}, no_corners, { 1, 0, 0, 0 }),
+        TestCase{"unknown", []{
+            try {
+                with_dialect("unknown", [](auto) {});
+                return false;
+            } catch (const std::runtime_error&) {
+                return true;
+            }
+        } },
+    };
+    const std::string prefix = "\n  " + plan_type_name(PlanType{}) + " ";
+    return run(cases, prefix.c_str());
+}
+
+template<typename PlanType>
+bool test_doors() {
+    const auto test = [](std::string name, std::string data, Rooms expected_rooms, Doors expected_doors) {
+        return TestCase{name, [=] {
+            PlanType plan;
+            std::istringstream input(data);
+            plan.read(input);
+            const Rooms rooms = plan.find_chairs_in_rooms();
+            if (rooms != expected_rooms || plan.door_graph() != expected_doors) {
+                std::cerr << "found:\n" << rooms << plan.door_graph() << "\n != expected:\n" << expected_rooms << expected_doors << "\n";
+                return false;
+            }
+            return true;
+        }};
+    };
+    const auto cases = {
+        test("no doors", "(a) W", { Room{"total", Pos{}, { 1, 0, 0, 0 }}, Room{"a", Pos{0, 0}, { 1, 0, 0, 0 }} }, {}),
+        test("three rooms",
+            "+-----+-----+\n"
+            "|(b) W|(a)  |\n"
+            "|     D   P |\n"
+            "+--D--+-----+\n"
+            "|(c)  C     D\n"
+            "+-----------+\n", {
+            Room{ "total", Pos{ 0, 0}, ChairCount{ 1, 1, 0, 1 } },
+            Room{ "a",     Pos{ 7, 1}, ChairCount{ 0, 1, 0, 0 } },
+            Room{ "b",     Pos{ 1, 1}, ChairCount{ 1, 0, 0, 0 } },
+            Room{ "c",     Pos{ 1, 4}, ChairCount{ 0, 0, 0, 1 } },
+        }, {
+            Door{ Pos{ 6, 2}, { "a", "b" } },
+            Door{ Pos{ 3, 3}, { "b", "c" } },
+            Door{ Pos{12, 4}, { "c" } },
+        }),
+        test("thick wall",
+            "+---+---+\n"
+            "|(a)DDD  |\n"
+            "|   |(b) |\n"
+            "+-D-+-D--+\n"
+            "+-D-+-D--+\n"
+            "|(c)     |\n"
+            "+--------+\n", {
+            Room{ "total", Pos{ 0, 0}, ChairCount{} },
+            Room{ "a",     Pos{ 1, 1}, ChairCount{} },
+            Room{ "b",     Pos{ 5, 2}, ChairCount{} },
+            Room{ "c",     Pos{ 1, 5}, ChairCount{} },
+        }, {
+            Door{ Pos{ 4, 1}, { "a", "b" } },
+            Door{ Pos{ 2, 3}, { "a", "c" } },
+            Door{ Pos{ 6, 3}, { "b", "c" } },
+        }),
+    };
+    const std::string prefix = "\n  " + plan_type_name(PlanType{}) + " ";
+    return run(cases, prefix.c_str());
+}
 
-        Room total{"total"}; // pseudo room for total count
-    
-        for (Room room : find_rooms()) {
-            find_chairs(room, total);
-            rooms.push_back(room);
+bool test_sparse_grid() {
+    const auto test = [](std::string name, std::string data, size_t max_tiles) {
+        return TestCase{name, [=] {
+            Plan plan;
+            SparsePlan sparse;
+            std::istringstream input(data), sparse_input(data);
+            plan.read(input);
+            sparse.read(sparse_input);
+            if (sparse.cells().stored_tiles() > max_tiles) {
+                std::cerr << "stored tiles: " << sparse.cells().stored_tiles() << " > " << max_tiles << "\n";
+                return false;
+            }
+            return sparse.find_chairs_in_rooms<Diagonal>() == plan.find_chairs_in_rooms<Diagonal>()
+                && sparse.door_graph() == plan.door_graph();
+        }};
+    };
+    // Site plan with the building placed on a blank canvas
+    const auto site = [](size_t width, size_t height, ssize_t left, ssize_t top, const std::string& building) {
+        std::vector<std::string> lines(height, std::string(width, ' '));
+        std::istringstream input(building);
+        ssize_t y = top;
+        for (std::string line; std::getline(input, line); ++y) {
+            lines.at(y).replace(left, line.size(), line);
         }
-        rooms.insert(rooms.begin(), total);
-        return rooms;
-    }
-private:
-    std::set<Room> find_rooms() {
-        std::set<Room> rooms;
-        const std::regex pattern("\\(([^)]*)\\)");
-        ssize_t y = 0;
-        for (auto& line : plan) {
-            for (auto it = std::sregex_iterator{line.begin(), line.end(), pattern}, end = std::sregex_iterator{}; it != end; ++it) {
-                const auto& match = *it;
-                const auto name = trim(match.str(1));
-                const auto pos = Pos{match.position(), y};
-                if (name.empty()) {
-                    throw std::runtime_error("Empty room name at " + pos.str());
-                }
-                const auto [existing, inserted] = rooms.emplace(name, pos, ChairCount{});
-                if (!inserted) {
-                    throw std::runtime_error("Duplicate room name " + name + ", initially defined at " + existing->pos.str());
-                }
-                std::fill_n(line.begin() + match.position(), match.length(), ' '); // erase room name in the plan
-            } 
-            ++y;
+        std::string plan;
+        for (const auto& line : lines) {
+            plan += line + '\n';
         }
-        return rooms;
-    }
+        return plan;
+    };
+    // Hall spanning many open tiles
+    const auto hall = [](size_t width, size_t height) {
+        std::string plan = "+" + std::string(width - 2, '-') + "+\n";
+        for (size_t y = 1; y + 1 < height; ++y) {
+            std::string line = "|" + std::string(width - 2, ' ') + "|\n";
+            if (y == 1) {
+                line.replace(2, 6, "(hall)");
+            } else if (y % 20 == 0) {
+                line[(y * 37) % (width - 2) + 1] = ChairTypes[y % ChairTypes.size()];
+            }
+            plan += line;
+        }
+        return plan + plan.substr(0, width / 2) + "D" + plan.substr(width / 2 + 1, width - width / 2);
+    };
+    const auto cases = {
+        test("empty", "", 0),
+        test("rooms.txt", RoomsPlan, 20),
+        test("site", site(2000, 300, 1000, 100, RoomsPlan), 8 + 19), // and a partial right edge tile per band
+        test("hall", hall(1000, 500), 1000),
+        test("site hall", site(3000, 1000, 700, 300, hall(1000, 500)), 1000),
+        test("wall corner", [] {
+            // the open top left tile touches a wall corner without '+' at its diagonal,
+            // the rooms don't leak into each other through it
+            std::vector<std::string> lines(40, std::string(200, ' '));
+            lines[16].replace(0, 64, std::string(64, '-'));
+            for (size_t y = 0; y < 16; ++y) {
+                lines[y][64] = '|';
+            }
+            lines[5].replace(10, 4, "(in)");
+            lines[30].replace(100, 5, "(out)");
+            lines[35][150] = 'W';
+            std::string plan;
+            for (const auto& line : lines) {
+                plan += line + '\n';
+            }
+            return plan;
+        }(), 40),
+    };
+    return run(cases, "\n  ");
+}
 
-    void find_chairs(Room& room, Room& total) {
-        // Use non-recursive flood fill algorithm with 4 directions
-        // (see https://en.wikipedia.org/wiki/Flood_fill)
-        // Visited cells will be marked as X on the plan
-        const auto directions = { Pos{0, 1}, Pos{0, -1}, Pos{1, 0}, Pos{-1, 0} };
-        std::queue<Pos> q;
-        q.push(room.pos);
-        while (!q.empty()) {
-            auto pos = q.front(); q.pop();
-            auto& cell = plan[pos.y][pos.x];
-            if (cell == Visited) {
-                continue;
-            } else if (const int type = chair_type(cell); type >= 0) {
-                room.chairs[type] += 1;
-                total.chairs[type] += 1;
-            }
-            cell = Visited;
-            for (const auto& [dx, dy] : directions) {
-                const Pos new_pos{pos.x + dx, pos.y + dy};
-                if (0 <= new_pos.y && new_pos.y < plan.size() && 0 <= new_pos.x && new_pos.x < plan[new_pos.y].size()) {
-                    const auto cell = plan[new_pos.y][new_pos.x];
-                    if (cell != Visited && !is_wall(cell)) {
-                        q.push(new_pos);
-                    }
+bool test_stats() {
+    const auto cases = {
+        TestCase{"phase scope", []{
+            const Phase outer = PhaseScope::phase();
+            bool ok = true;
+            {
+                PhaseScope fill(Phase::Fill);
+                ok = ok && PhaseScope::phase() == Phase::Fill;
+                {
+                    PhaseScope sort(Phase::Sort);
+                    ok = ok && PhaseScope::phase() == Phase::Sort;
                 }
+                ok = ok && PhaseScope::phase() == Phase::Fill;
             }
-        }
-    }
-};
+            return ok && PhaseScope::phase() == outer;
+        } },
+        TestCase{"time", []{
+            stats_enabled = true;
+            const uint64_t before = PhaseScope::nanoseconds(Phase::Output);
+            {
+                PhaseScope output(Phase::Output);
+                const auto start = std::chrono::steady_clock::now();
+                while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(1)) {
+                }
+            }
+            stats_enabled = false;
+            return PhaseScope::nanoseconds(Phase::Output) - before >= 1000 * 1000;
+        } },
+#if defined(CHAIRS_ALLOC_STATS)
+        TestCase{"allocations", []{
+            const auto& stats = phase_stats[static_cast<size_t>(Phase::Output)];
+            const uint64_t allocations = stats.allocations, bytes = stats.bytes;
+            const int64_t current = stats.current;
+            {
+                PhaseScope output(Phase::Output);
+                std::vector<char> buffer(1000);
+                std::string str(100, 'x');
+                if (stats.current - current < 1100 || stats.peak < 1100) {
+                    return false;
+                }
+            }
+            return stats.allocations - allocations == 2
+                && stats.bytes - bytes >= 1100
+                && stats.current == current;
+        } },
+#endif
+    };
+    return run(cases, "\n  ");
+}
 
-bool test_trim() {
-    auto test = [](std::string str, std::string expected) {
-            return TestCase{str, [=]{ return trim(str) == expected; } };
+bool test_capture() {
+    const auto cases = {
+        TestCase{"varint", []{
+            std::stringstream data;
+            const auto values = { 0ull, 1ull, 127ull, 128ull, 300ull, 1ull << 40, ~0ull };
+            for (uint64_t value : values) {
+                write_varint(data, value);
+            }
+            uint64_t value = 0;
+            for (uint64_t expected : values) {
+                if (!read_varint(data, value) || value != expected) {
+                    return false;
+                }
+            }
+            return !read_varint(data, value);
+        } },
+        TestCase{"record", []{
+            const CaptureRecord record{12345, PlanOptions{"diagonal", true, false}, "(a) W\n"};
+            std::stringstream data;
+            record.write(data);
+            record.write(data);
+            CaptureRecord read;
+            size_t count = 0;
+            for (; read.read(data); ++count) {
+                if (read.timestamp != record.timestamp || read.plan != record.plan || read.options.dialect != record.options.dialect
+                        || read.options.doors != record.options.doors || read.options.sparse != record.options.sparse) {
+                    return false;
+                }
+            }
+            return count == 2;
+        } },
+        TestCase{"concurrent append", []{
+            // writers creating the file at once, the header is written once and first
+            const TempFile file("append.bin");
+            const std::string& path = file.path;
+            std::vector<std::thread> writers;
+            for (size_t i = 0; i < 8; ++i) {
+                writers.emplace_back([&path] { append_file(path, "header\n", "record\n"); });
+            }
+            for (auto& writer : writers) {
+                writer.join();
+            }
+            std::ifstream in(path);
+            const std::string data{std::istreambuf_iterator<char>(in), {}};
+            std::string expected = "header\n";
+            for (size_t i = 0; i < 8; ++i) {
+                expected += "record\n";
+            }
+            return data == expected;
+        } },
+        TestCase{"truncated", []{
+            std::stringstream data;
+            CaptureRecord{1, PlanOptions{}, "(a) W\n"}.write(data);
+            std::istringstream truncated(data.str().substr(0, data.str().size() - 1));
+            try {
+                CaptureRecord{}.read(truncated);
+                return false;
+            } catch (const std::runtime_error&) {
+                return true;
+            }
+        } },
+        TestCase{"latencies", []{
+            Latencies latencies;
+            for (int i = 100; i > 0; --i) {
+                latencies.add(std::chrono::nanoseconds(i));
+            }
+            return latencies.percentile(50).count() == 50 && latencies.percentile(99).count() == 99
+                && latencies.percentile(99.9).count() == 100 && latencies.percentile(0).count() == 1;
+        } },
+        TestCase{"replay", []{
+            const TempFile file("capture");
+            const std::string& capture = file.path;
+            for (const char* plan : { "(a) W\n", "(b) P\n", "(c) (c)\n" }) {
+                std::ostringstream data;
+                CaptureRecord{CaptureRecord::now(), PlanOptions{}, plan}.write(data);
+                append_file(capture, CaptureMagic, data.str());
+            }
+            std::ostringstream out;
+            replay(capture, true, out);
+            return out.str().rfind("replay:\nplans: 3, errors: 1,", 0) == 0;
+        } },
     };
+    return run(cases, "\n  ");
+}
+
+bool test_server() {
     const auto cases = {
-        test("", ""),
-        test("    ", ""),
-        test(" aa bb c", "aa bb c"),
-        test("aaa    bbb cc    ", "aaa    bbb cc"),
-        test("   a   bb    ccc     ", "a   bb    ccc"),
+        TestCase{"requests", []{
+            const TempFile socket("server.sock");
+            const std::string& path = socket.path;
+            Server server(path);
+            std::thread thread(&Server::run, &server);
+            bool ok = false;
+            try {
+                Client client(path);
+                ok = client.request(PlanOptions{}, "(a) W P\n") == "total:\nW: 1, P: 1, S: 0, C: 0\na:\nW: 1, P: 1, S: 0, C: 0\n"
+                    && client.request(PlanOptions{"classic", true}, "(a) D (b)\n").find("doors:\na - b at (4, 0)\n") != std::string::npos;
+                try {
+                    client.request(PlanOptions{}, "(a) (a)");
+                    ok = false;
+                } catch (const std::runtime_error& ex) {
+                    ok = ok && std::string(ex.what()).rfind("Duplicate room name a", 0) == 0;
+                }
+            } catch (...) {
+            }
+            server.stop();
+            thread.join();
+            return ok;
+        } },
+        TestCase{"memfd buffer", []{
+            // a memfd from MemfdThreshold bytes on, others grow in memory
+            const std::string data(3 * MemfdThreshold + 5, 'x');
+            MemfdStreambuf inline_buffer(false), small(true), large(true);
+            std::ostream(&inline_buffer) << data;
+            std::ostream(&small) << data.substr(0, MemfdThreshold - 1);
+            std::ostream(&large) << data;
+            const int fd = large.seal();
+            struct stat st;
+            const bool ok = inline_buffer.seal() < 0 && inline_buffer.output() == data && small.seal() < 0
+                && small.output().size() == MemfdThreshold - 1 && fd >= 0 && ::fstat(fd, &st) == 0
+                && static_cast<size_t>(st.st_size) == data.size() && ::fcntl(fd, F_GET_SEALS) & F_SEAL_WRITE;
+            ::close(fd);
+            return ok;
+        } },
+        TestCase{"memfd output", []{
+            // large outputs are mapped from a sealed memfd, small ones are inline
+            std::string plan;
+            for (size_t i = 0; i < 3000; ++i) {
+                plan += "|(room " + std::to_string(i) + ") W|\n";
+            }
+            std::istringstream input(plan);
+            std::ostringstream expected;
+            process_plan(input, PlanOptions{}, expected);
+            const TempFile socket("server.sock");
+            const std::string& path = socket.path;
+            Server server(path);
+            std::thread thread(&Server::run, &server);
+            bool ok = false;
+            try {
+                Client client(path);
+                const Response large = client.query(PlanOptions{}, plan);
+                const Response small = client.query(PlanOptions{}, "(a) W\n");
+                ok = expected.str().size() >= MemfdThreshold && large.is_mapped() && large.output() == expected.str()
+                    && !small.is_mapped() && small.output().rfind("total:\nW: 1", 0) == 0
+                    && client.request(PlanOptions{}, plan) == expected.str();
+            } catch (...) {
+            }
+            server.stop();
+            thread.join();
+            return ok;
+        } },
+        TestCase{"load test", []{
+            const TempFile socket("server.sock");
+            const std::string& path = socket.path;
+            Server server(path);
+            std::thread thread(&Server::run, &server);
+            LoadOptions options;
+            options.path = path;
+            options.connections = 2;
+            options.duration = 0.05;
+            LoadResult closed = load_test(options, { RoomsPlan, "(a) W\n" });
+            options.rate = 200;
+            options.duration = 0.1;
+            LoadResult open = load_test(options, { RoomsPlan });
+            server.stop();
+            thread.join();
+            return closed.errors == 0 && closed.latencies.size() > 0
+                && open.errors == 0 && open.latencies.size() == 20;
+        } },
     };
     return run(cases, "\n  ");
 }
 
-bool test_is_wall() {
-    auto test = [](std::string str, bool expected = true) {
-            return TestCase{str, [=]{ return std::all_of(str.begin(), str.end(), is_wall) == expected; } };
+bool test_metrics() {
+    // value of the first exposition line starting with prefix
+    const auto value = [](const std::string& prefix) {
+        std::istringstream exposition(Metrics::exposition());
+        for (std::string line; std::getline(exposition, line);) {
+            if (line.rfind(prefix + ' ', 0) == 0) {
+                return std::stod(line.substr(prefix.size() + 1));
+            }
+        }
+        return -1.0;
     };
     const auto cases = {
-        test("+----+"),
-        test("|/\\"),
-        test(" \t   cc", false),
-        test(" Q asdf P R S W", false),
+        TestCase{"counters", [&value]{
+            const double plans = value("chairs_plans_processed_total"), errors = value("chairs_plan_errors_total");
+            const double cells = value("chairs_cells_processed_total");
+            const double fills = value("chairs_phase_duration_seconds_count{phase=\"fill\"}");
+            stats_enabled = true;
+            std::thread([] {
+                std::ostringstream out;
+                for (const char* plan : { "(a) W\n", "(b) P\n", "(c) (c)\n" }) {
+                    std::istringstream input(plan);
+                    try {
+                        process_plan(input, PlanOptions{}, out);
+                    } catch (const std::exception&) {
+                    }
+                }
+            }).join();
+            stats_enabled = false;
+            return value("chairs_plans_processed_total") - plans == 2 && value("chairs_plan_errors_total") - errors == 1
+                && value("chairs_cells_processed_total") - cells == 2 * 5
+                && value("chairs_phase_duration_seconds_count{phase=\"fill\"}") - fills == 2
+                && value("chairs_phase_duration_seconds_bucket{phase=\"fill\",le=\"+Inf\"}") >= 2
+                && value("process_resident_memory_bytes") > 0;
+        } },
+        TestCase{"in flight", [&value]{
+            // the gauge is back to 0 after the requests
+            const TempFile socket("server.sock");
+            const std::string& path = socket.path;
+            Server server(path);
+            std::thread thread(&Server::run, &server);
+            bool ok = false;
+            try {
+                Client client(path);
+                ok = client.request(PlanOptions{}, "(a) W\n").rfind("total:", 0) == 0
+                    && value("chairs_requests_in_flight") == 0;
+            } catch (...) {
+            }
+            server.stop();
+            thread.join();
+            return ok && value("chairs_requests_in_flight") == 0;
+        } },
+        TestCase{"pools", [&value]{
+            ThreadPool pool("metrics test", PoolOptions{1});
+            TaskGroup group(pool);
+            for (size_t i = 0; i < 3; ++i) {
+                group.run([] {});
+            }
+            group.wait();
+            return value("chairs_pool_threads{pool=\"metrics test\"}") == 1 && value("chairs_pool_tasks_total{pool=\"metrics test\"}") == 3
+                && value("chairs_pool_steals_total{pool=\"metrics test\"}") == 0;
+        } },
+        TestCase{"endpoint", []{
+            const TempFile socket("metrics.sock");
+            const std::string& path = socket.path;
+            MetricsEndpoint endpoint(path);
+            std::thread thread(&MetricsEndpoint::run, &endpoint);
+            std::string response;
+            try {
+                const sockaddr_un address = unix_address(path);
+                const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0) {
+                    const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+                    write_all(fd, request.data(), request.size());
+                    char buffer[4096];
+                    for (ssize_t n; (n = ::read(fd, buffer, sizeof(buffer))) > 0;) {
+                        response.append(buffer, n);
+                    }
+                }
+                ::close(fd);
+            } catch (...) {
+            }
+            endpoint.stop();
+            thread.join();
+            return response.rfind("HTTP/1.1 200 OK\r\n", 0) == 0
+                && response.find("\r\n\r\n# HELP chairs_plans_processed_total") != std::string::npos;
+        } },
     };
     return run(cases, "\n  ");
 }
 
-bool test_char_type() {
-    auto test = [](char chair, int type) {
-            return TestCase{std::string{"chair "} + chair, [=]{ return chair_type(chair) == type; } };
+bool test_batch() {
+    // temporary directory with plan files and manifest
+    struct Batch {
+        const TempFile temp{"batch"};
+        const std::string& dir = temp.path;
+        std::vector<std::string> plans;
+        Batch() {
+            ::mkdir(dir.c_str(), 0700);
+            const auto plans_data = { RoomsPlan, "(a) W\n", "(b) P P\n", "(x) (x)\n", "(c) S\n" };
+            std::ofstream manifest(dir + "/manifest");
+            for (const char* data : plans_data) {
+                plans.push_back(dir + "/plan" + std::to_string(plans.size()) + ".txt");
+                std::ofstream(plans.back()) << data;
+                manifest << plans.back() << '\n';
+            }
+        }
+        BatchOptions options(size_t shard_size = 100, double lease = 60) const {
+            BatchOptions options;
+            options.manifest = dir + "/manifest";
+            options.shard_dir = dir + "/shards";
+            options.shard_size = shard_size;
+            options.lease = lease;
+            return options;
+        }
+        // results of all shards without the shard totals
+        Results shard_results(size_t shards) const {
+            Results results;
+            for (size_t shard = 0; shard < shards; ++shard) {
+                std::ifstream in(dir + "/shards/shard-" + std::to_string(shard) + ".txt");
+                for (Result result; read_result(in, result);) {
+                    if (!result.plan.empty()) {
+                        results.push_back(result);
+                    }
+                }
+            }
+            std::sort(results.begin(), results.end());
+            return results;
+        }
     };
     const auto cases = {
-        test('A', -1),
-        test('-', -1),
-        test('|', -1),
-        test(' ', -1),
-        test('W', 0),
-        test('P', 1),
-        test('S', 2),
-        test('C', 3),
+        TestCase{"text", []{
+            const Results results = { Result{"", "", {1, 2, 3, 4}}, Result{"plan 1.txt", "living room", {10, 0, 200, 0}} };
+            std::stringstream data;
+            write_results(data, results);
+            Results read;
+            for (Result result; read_result(data, result);) {
+                read.push_back(result);
+            }
+            return read == results && data.str() == "\t\tW: 1, P: 2, S: 3, C: 4\nplan 1.txt\tliving room\tW: 10, P: 0, S: 200, C: 0\n";
+        } },
+        TestCase{"formats", []{
+            const Results results = { Result{"", "", {1, 2, 3, 4}}, Result{"a,\"b\".txt", "c, d", {300, 0, 2, 0}} };
+            const auto formats = { "text", "csv", "binary" };
+            return std::all_of(formats.begin(), formats.end(), [&results](const char* name) {
+                std::stringstream data;
+                write_results(data, results, result_format(name));
+                ResultReader reader(data);
+                Results read;
+                for (Result result; reader.read(result);) {
+                    read.push_back(result);
+                }
+                return read == results;
+            });
+        } },
+        TestCase{"csv line breaks", []{
+            const Results results = { Result{"a\nb.txt", "c\r\nd\r", {1, 0, 0, 0}}, Result{"e", "", {0, 1, 0, 0}} };
+            std::stringstream data;
+            write_results(data, results, ResultFormat::Csv);
+            ResultReader reader(data);
+            Results read;
+            for (Result result; reader.read(result);) {
+                read.push_back(result);
+            }
+            return read == results;
+        } },
+        TestCase{"merge", []{
+            std::stringstream text, csv, binary, empty, merged;
+            write_results(text, { Result{"", "", {1, 0, 0, 0}}, Result{"a", "", {1, 0, 0, 0}}, Result{"c", "x", {0, 0, 0, 1}} });
+            write_results(csv, { Result{"", "", {2, 0, 0, 0}}, Result{"b", "", {2, 0, 0, 0}} }, ResultFormat::Csv);
+            write_results(binary, { Result{"a", "", {0, 3, 0, 0}}, Result{"c", "x", {0, 0, 0, 2}} }, ResultFormat::Binary);
+            ResultWriter writer(merged, ResultFormat::Text);
+            merge_results({ &text, &csv, &binary, &empty }, writer);
+
+            std::stringstream unsorted("b\t\tW: 1, P: 0, S: 0, C: 0\na\t\tW: 1, P: 0, S: 0, C: 0\n"), out;
+            ResultWriter unsorted_writer(out, ResultFormat::Text);
+            bool thrown = false;
+            try {
+                merge_results({ &unsorted }, unsorted_writer);
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            return thrown && merged.str() == "\t\tW: 3, P: 0, S: 0, C: 0\n"
+                "a\t\tW: 1, P: 3, S: 0, C: 0\n"
+                "b\t\tW: 2, P: 0, S: 0, C: 0\n"
+                "c\tx\tW: 0, P: 0, S: 0, C: 3\n";
+        } },
+        TestCase{"single process", []{
+            const Batch batch;
+            std::ostringstream errors;
+            const Results results = analyze_batch(batch.plans.begin(), batch.plans.end(), batch.options(), errors);
+            return results.size() == 1 + 9 + 2 + 2 + 2 && results[0] == Result{"", "", {15, 9, 4, 1}}
+                && results[1] == Result{batch.plans[0], "", {14, 7, 3, 1}}
+                && errors.str() == batch.plans[3] + ": Duplicate room name x, initially defined at (0, 0)\n";
+        } },
+        TestCase{"pool tasks", []{
+            // plans analyzed by the pool tasks in any order give the results in the manifest order
+            const Batch batch;
+            Results expected;
+            for (const auto& plan : batch.plans) {
+                std::string error;
+                const Results results = analyze_batch_plan(plan, batch.options(), error);
+                expected.insert(expected.end(), results.begin(), results.end());
+            }
+            add_batch_total(expected);
+            std::ostringstream errors;
+            size_t done = 0;
+            const Results results = analyze_batch(batch.plans.begin(), batch.plans.end(), batch.options(), errors,
+                [&done](const std::string&, const Results&) { ++done; });
+            return results == expected && done == batch.plans.size();
+        } },
+        TestCase{"placement", []{
+            const auto nodes = numa_nodes();
+            const auto placement = place_thread(0, false);
+            const auto stats = ThreadPool("placement test", PoolOptions{3}).stats();
+            return parse_cpu_list("0-3,8,10-11\n") == std::vector<int>{0, 1, 2, 3, 8, 10, 11} && parse_cpu_list("").empty()
+                && !nodes.empty() && !nodes[0].empty() && !placement.pinned && placement.node >= 0
+                && stats.placements.size() <= 2 && std::all_of(stats.placements.begin(), stats.placements.end(),
+                    [](const ThreadPlacement& placement) { return placement.worker == 1 || placement.worker == 2; });
+        } },
+        TestCase{"checkpoint", []{
+            const Batch batch;
+            BatchOptions options = batch.options();
+            options.shard_dir.clear();
+            options.checkpoint = batch.dir + "/checkpoint";
+            std::ostringstream full, errors;
+            run_batch(options, full, errors);
+
+            // crash with a torn tail, then resume with a changed completed plan and a new one
+            std::ofstream(options.checkpoint, std::ios::app) << batch.plans[1] << "\tz\tW: 1, P";
+            std::ofstream(batch.plans[1]) << "(a) P\n";
+            const std::string added = batch.dir + "/added.txt";
+            std::ofstream(added) << "(d) C\n";
+            std::ofstream(options.manifest, std::ios::app) << added << '\n';
+            options.resume = true;
+            std::ostringstream resumed;
+            run_batch(options, resumed, errors);
+            std::ifstream in(options.checkpoint);
+            const std::string checkpoint{std::istreambuf_iterator<char>(in), {}};
+
+            // start over without resume
+            options.resume = false;
+            std::ostringstream restarted;
+            run_batch(options, restarted, errors);
+            const std::string added_results = added + "\t\tW: 0, P: 0, S: 0, C: 1\n" + added + "\td\tW: 0, P: 0, S: 0, C: 1\n";
+            return resumed.str().find("\t\tW: 15, P: 9, S: 4, C: 2\n" + added_results) == 0
+                && resumed.str().find(batch.plans[1] + "\ta\tW: 1, P: 0") != std::string::npos
+                && restarted.str().find(batch.plans[1] + "\ta\tW: 0, P: 1") != std::string::npos
+                && checkpoint.find("\tz\t") == std::string::npos
+                && checkpoint.compare(checkpoint.size() - 8, 8, "#commit\n") == 0;
+        } },
+        TestCase{"checkpoint options", []{
+            // results of other plan options are not resumed
+            const Batch batch;
+            BatchOptions options = batch.options();
+            options.shard_dir.clear();
+            options.checkpoint = batch.dir + "/checkpoint";
+            std::ostringstream out, errors;
+            run_batch(options, out, errors);
+            options.resume = true;
+            options.plan.dialect = Diagonal::name;
+            try {
+                run_batch(options, out, errors);
+            } catch (const std::runtime_error& ex) {
+                return std::string(ex.what()).find("other plan options: #options\tdialect=classic\t") != std::string::npos;
+            }
+            return false;
+        } },
+        TestCase{"worker processes", []{
+            const Batch batch;
+            const BatchOptions options = batch.options(2);
+            std::vector<pid_t> workers(3);
+            for (pid_t& pid : workers) {
+                std::string args[] = { "chairs-planner", "--batch=" + options.manifest, "--shard-dir=" + options.shard_dir, "--shard-size=2" };
+                char* argv[] = { args[0].data(), args[1].data(), args[2].data(), args[3].data(), nullptr };
+                posix_spawn_file_actions_t actions;
+                posix_spawn_file_actions_init(&actions);
+                posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+                if (posix_spawn(&pid, "/proc/self/exe", &actions, nullptr, argv, environ) != 0) {
+                    return false;
+                }
+                posix_spawn_file_actions_destroy(&actions);
+            }
+            bool ok = true;
+            for (pid_t pid : workers) {
+                int status = 0;
+                ok = ok && ::waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            }
+            std::ostringstream errors;
+            Results expected = analyze_batch(batch.plans.begin(), batch.plans.end(), options, errors);
+            expected.erase(expected.begin()); // batch total
+            return ok && batch.shard_results(3) == expected && !file_exists(options.shard_dir + "/shard-0.lease");
+        } },
+        TestCase{"merge shards", []{
+            const Batch batch;
+            const BatchOptions options = batch.options(2);
+            std::ostringstream errors, expected, merged;
+            run_batch_worker(options, errors);
+            std::vector<std::ifstream> files;
+            std::vector<std::istream*> shards;
+            files.reserve(3);
+            for (size_t shard = 0; shard < 3; ++shard) {
+                shards.push_back(&files.emplace_back(options.shard_dir + "/shard-" + std::to_string(shard) + ".txt"));
+            }
+            ResultWriter writer(merged, ResultFormat::Text);
+            merge_results(shards, writer);
+            write_results(expected, analyze_batch(batch.plans.begin(), batch.plans.end(), options, errors));
+            return merged.str() == expected.str();
+        } },
+        TestCase{"expired lease", []{
+            const Batch batch;
+            const BatchOptions options = batch.options(2, 0.2);
+            ::mkdir(options.shard_dir.c_str(), 0755);
+            std::ofstream(options.shard_dir + "/shard-1.lease") << "crashed.worker";
+            std::ostringstream errors;
+            const auto start = std::chrono::steady_clock::now();
+            const size_t processed = run_batch_worker(options, errors);
+            return processed == 3 && std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(200)
+                && batch.shard_results(3).size() == 9 + 2 + 2 + 2 && !file_exists(options.shard_dir + "/shard-1.lease");
+        } },
+        TestCase{"lease takeover", []{
+            const Batch batch;
+            const BatchOptions options = batch.options(2);
+            ::mkdir(options.shard_dir.c_str(), 0755);
+            const std::string path = options.shard_dir + "/shard-0.lease";
+            std::ofstream(path) << "crashed.worker";
+            const timespec old[2] = { {0, UTIME_OMIT}, {1, 0} };
+            ::utimensat(AT_FDCWD, path.c_str(), old, 0);
+            std::string holder;
+            timespec mtime;
+            bool ok = true;
+            {
+                const Lease a(path, 60, "a");
+                const Lease b(path, 60, "b"); // fresh lease of a
+                ok = a && !b && read_lease(path, holder, mtime) && holder == "a";
+                std::ofstream(path) << "c"; // taken over from a
+            }
+            return ok && read_lease(path, holder, mtime) && holder == "c";
+        } },
     };
     return run(cases, "\n  ");
 }
@@ -234,15 +6202,39 @@ bool test_room() {
             const Room room{ "name", Pos{10, 10}, ChairCount{ 1, 2, 3, 4 } };
             return room.chairs_str() == "W: 1, P: 2, S: 3, C: 4";
         } },
+        TestCase{"radix_sort", []{
+            // names with common prefixes, non-ASCII bytes and duplicates, in the plan order
+            uint32_t random = 1;
+            const auto make_rooms = [&random](size_t count) {
+                Rooms rooms;
+                for (size_t i = 0; i < count; ++i) {
+                    std::string name;
+                    for (size_t length = (random = random * 1103515245 + 12345) >> 16 & 7; length > 0; --length) {
+                        name += "ab\xC3\xA9 z"[((random = random * 1103515245 + 12345) >> 16) % 6];
+                    }
+                    rooms.emplace_back(name, Pos{0, static_cast<ssize_t>(i)});
+                }
+                return rooms;
+            };
+            const auto sorted_as_strings = [](Rooms rooms, size_t parallel_threshold) {
+                Rooms expected = rooms;
+                std::stable_sort(expected.begin(), expected.end());
+                radix_sort(rooms, [](const Room& room) -> std::string_view { return room.name; }, parallel_threshold);
+                return rooms == expected;
+            };
+            return sorted_as_strings(make_rooms(10), 1 << 16) && sorted_as_strings(make_rooms(1000), 1 << 16)
+                && sorted_as_strings(make_rooms(5000), 100);
+        } },
     };
     return run(cases, "\n  ");
 }
 
+template<typename PlanType>
 bool test_plan() {
     const auto test = [](std::string name, std::string data, Rooms expected, const bool fail = false) {
         return TestCase{name, [=] {
             try {
-                Plan plan;
+                PlanType plan;
                 std::istringstream input(data);
                 plan.read(input);
                 const Rooms found = plan.find_chairs_in_rooms();
@@ -263,68 +6255,26 @@ bool test_plan() {
         }};
     };
 
-    const auto rooms = R"(
-+-----------+------------------------------------+
-|           |                                    |
-| (closet)  |                                    |
-|         P |                            S       |
-|         P |         (sleeping room)            |
-|         P |                                    |
-|           |                                    |
-+-----------+    W                               |
-|           |                                    |
-|        W  |                                    |
-|           |                                    |
-|           +--------------+---------------------+
-|                          |                     |
-|                          |                W W  |
-|                          |    (office)         |
-|                          |                     |
-+--------------+           |                     |
-|              |           |                     |
-| (toilet)     |           |             P       |
-|   C          |           |                     |
-|              |           |                     |
-+--------------+           +---------------------+
-|              |           |                     |
-|              |           |                     |
-|              |           |                     |
-| (bathroom)   |           |      (kitchen)      |
-|              |           |                     |
-|              |           |      W   W          |
-|              |           |      W   W          |
-|       P      +           |                     |
-|             /            +---------------------+
-|            /                                   |
-|           /                                    |
-|          /                          W    W   W |
-+---------+                                      |
-|                                                |
-| S                                   W    W   W |
-|                (living room)                   |
-| S                                              |
-|                                                |
-|                                                |
-|                                                |
-|                                                |
-+--------------------------+---------------------+
-                           |                     |
-                           |                  P  |
-                           |  (balcony)          |
-                           |                 P   |
-                           |                     |
-                           +---------------------+
-)"; 
 
     const auto cases = {
         TestCase{"ctor", []{
-            Plan plan;
+            PlanType plan;
             return plan.find_chairs_in_rooms() == Rooms{ Room{"total"} };
         } },
         test("empty", "", { Room{"total"} }),
         test("no room name", "()", {}, true),
         test("duplicate room name", "(A) (A)", {}, true),
-        test("rooms.txt", rooms, {
+        test("box drawing",
+            "┌───────┬──────┐\n"
+            "│ (a) W │ (b)  │\n"
+            "│  P    ├──╲   │\n"
+            "│     C │   ╲ S│\n"
+            "└───────┴────┴─┘\n", {
+            Room{ "total", Pos{ 0, 0}, ChairCount{ 1, 1, 1, 1 } },
+            Room{ "a",     Pos{ 2, 1}, ChairCount{ 1, 1, 0, 1 } },
+            Room{ "b",     Pos{10, 1}, ChairCount{ 0, 0, 1, 0 } },
+        }),
+        test("rooms.txt", RoomsPlan, {
             // { name, pos, chairs: W P S C } }
             Room{ "total",         Pos{ 0,  0}, ChairCount{14, 7, 3, 1 } },
             Room{ "balcony",       Pos{30, 47}, ChairCount{ 0, 2, 0, 0 } },
@@ -336,31 +6286,333 @@ bool test_plan() {
             Room{ "sleeping room", Pos{22,  5}, ChairCount{ 1, 0, 1, 0 } },
             Room{ "toilet",        Pos{ 2, 19}, ChairCount{ 0, 0, 0, 1 } },
         }),
+        TestCase{"chair positions", []{
+            PlanType plan;
+            std::istringstream input(RoomsPlan);
+            plan.read(input);
+            const Rooms rooms = plan.find_chairs_in_rooms();
+            if constexpr (std::is_same_v<std::decay_t<decltype(plan.chair_counter())>, ChairPositions>) {
+                std::vector<ChairCount> counts(rooms.size());
+                for (const ChairPosition& chair : plan.chair_counter().chairs) {
+                    counts.at(chair.room)[chair.type] += 1;
+                }
+                for (size_t i = 1; i < rooms.size(); ++i) {
+                    if (counts[i] != rooms[i].chairs) {
+                        return false;
+                    }
+                }
+                return plan.chair_counter().chairs.size() == 14 + 7 + 3 + 1;
+            }
+            return true;
+        } },
+        TestCase{"static", []{
+            PlanType plan;
+            std::istringstream input(RoomsPlan);
+            plan.read(input);
+            Rooms rooms;
+            for (size_t i = 0; i < RoomsLayout.room_count; ++i) {
+                const auto& room = RoomsLayout.rooms[i];
+                rooms.emplace_back(std::string(room.name), room.pos, room.chairs);
+            }
+            bool labels = true;
+            const auto found = plan.find_chairs_in_rooms();
+            for (ssize_t y = 0; y < static_cast<ssize_t>(RoomsLayout.grid.lines); ++y) {
+                for (ssize_t x = 0; RoomsLayout.grid.offset({x, y}) >= 0; ++x) {
+                    labels = labels && (RoomsLayout.room_at({x, y}) != nullptr) == (plan.cells().get({x, y}) == Visited);
+                }
+            }
+            return labels && rooms == found;
+        } },
     };
-    return run(cases, "\n  ");
+    const std::string prefix = "\n  " + plan_type_name(PlanType{}) + " ";
+    return run(cases, prefix.c_str());
 }
+
+struct Options : PlanOptions {
+    std::vector<std::string> files; // plan file, or load test corpus
+    std::string record; // capture file to record processed plans
+    std::string replay; // capture file to replay
+    std::string serve; // server socket path
+    std::string metrics; // metrics endpoint socket path
+    LoadOptions load; // load test of the server at load.path
+    BatchOptions batch; // batch processing of batch.manifest
+    bool merge = false; // merge sorted result files
+    std::string convert; // plan format to convert the plan to
+    std::string room; // name of the only room to print
+    bool index = false; // write the line index sidecar of the plan
+    std::string region; // cells "x1,y1,x2,y2" of the plan to print
+    std::string route; // cells "x1,y1,x2,y2" to route between
+    SimulationOptions simulation; // delivery simulation with simulation.workers
+    bool clearance = false; // check chairs fit on the routes from simulation.entrance
+    ChairFootprints footprints = DefaultFootprints;
+    bool max_speed = false;
+    bool stats = false;
+    bool test = false;
+
+    Options(int argc, char* argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (arg == "--test") {
+                test = true;
+            } else if (arg.rfind("--test-threads=", 0) == 0) {
+                test_options.threads = std::max(1ul, std::stoul(arg.substr(arg.find('=') + 1)));
+            } else if (arg.rfind("--test-repeat=", 0) == 0) {
+                test_options.repeat = std::max(1ul, std::stoul(arg.substr(arg.find('=') + 1)));
+            } else if (arg.rfind("--test-budget=", 0) == 0) {
+                test_options.budget = std::stod(arg.substr(arg.find('=') + 1));
+            } else if (arg == "--test-timing") {
+                test_options.timing = true;
+            } else if (arg == "--stats") {
+                stats = true;
+            } else if (arg == "--sparse") {
+                sparse = true;
+            } else if (arg == "--doors") {
+                doors = true;
+            } else if (arg.rfind("--dialect=", 0) == 0) {
+                dialect = arg.substr(arg.find('=') + 1);
+            } else if (arg.rfind("--record=", 0) == 0) {
+                record = arg.substr(arg.find('=') + 1);
+            } else if (arg.rfind("--replay=", 0) == 0) {
+                replay = arg.substr(arg.find('=') + 1);
+            } else if (arg == "--max-speed") {
+                max_speed = true;
+            } else if (arg.rfind("--serve=", 0) == 0) {
+                serve = arg.substr(arg.find('=') + 1);
+            } else if (arg.rfind("--batch=", 0) == 0) {
+                batch.manifest = arg.substr(arg.find('=') + 1);
+            } else if (arg.rfind("--shard-dir=", 0) == 0) {
+                batch.shard_dir = arg.substr(arg.find('=') + 1);
+            } else if (arg.rfind("--threads=", 0) == 0) {
+                ThreadPool::shared_options.threads = std::max(1ul, std::stoul(arg.substr(arg.find('=') + 1)));
+            } else if (arg == "--pin") {
+                ThreadPool::shared_options.pin = true;
+            } else if (arg.rfind("--shard-size=", 0) == 0) {
+                batch.shard_size = std::max(1ul, std::stoul(arg.substr(arg.find('=') + 1)));
+            } else if (arg.rfind("--checkpoint=", 0) == 0) {
+                batch.checkpoint = arg.substr(arg.find('=') + 1);
+            } else if (arg == "--resume") {
+                batch.resume = true;
+            } else if (arg.rfind("--simulate=", 0) == 0) {
+                simulation.workers = std::stoul(arg.substr(arg.find('=') + 1));
+            } else if (arg.rfind("--entrance=", 0) == 0) {
+                std::istringstream pos(arg.substr(arg.find('=') + 1));
+                char comma = 0;
+                if (!(pos >> simulation.entrance.x >> comma >> simulation.entrance.y) || comma != ',') {
+                    throw std::runtime_error("Invalid entrance " + arg);
+                }
+            } else if (arg == "--clearance") {
+                clearance = true;
+            } else if (arg.rfind("--footprint=", 0) == 0) {
+                // comma separated chair type and square side pairs, e.g. S:3,W:2
+                std::istringstream sizes(arg.substr(arg.find('=') + 1));
+                for (std::string item; std::getline(sizes, item, ',');) {
+                    const int8_t type = (item.size() > 2 && item[1] == ':' ? chair_type(item[0]) : -1);
+                    if (type < 0) {
+                        throw std::runtime_error("Invalid footprint " + item);
+                    }
+                    footprints[type] = std::max(1ul, std::stoul(item.substr(2)));
+                }
+            } else if (arg.rfind("--walk=", 0) == 0) {
+                simulation.walk = std::stod(arg.substr(arg.find('=') + 1));
+            } else if (arg.rfind("--carry=", 0) == 0) {
+                // comma separated chair type and time pairs, e.g. S:3,W:1.5
+                std::istringstream times(arg.substr(arg.find('=') + 1));
+                for (std::string item; std::getline(times, item, ',');) {
+                    const int8_t type = (item.size() > 2 && item[1] == ':' ? chair_type(item[0]) : -1);
+                    if (type < 0) {
+                        throw std::runtime_error("Invalid carry time " + item);
+                    }
+                    simulation.carry[type] = std::stod(item.substr(2));
+                }
+            } else if (arg.rfind("--route=", 0) == 0) {
+                route = arg.substr(arg.find('=') + 1);
+            } else if (arg.rfind("--room=", 0) == 0) {
+                room = arg.substr(arg.find('=') + 1);
+            } else if (arg == "--index") {
+                index = true;
+            } else if (arg.rfind("--region=", 0) == 0) {
+                region = arg.substr(arg.find('=') + 1);
+            } else if (arg.rfind("--convert=", 0) == 0) {
+                convert = arg.substr(arg.find('=') + 1);
+            } else if (arg == "--merge") {
+                merge = true;
+            } else if (arg.rfind("--format=", 0) == 0) {
+                batch.format = result_format(arg.substr(arg.find('=') + 1));
+            } else if (arg.rfind("--lease=", 0) == 0) {
+                batch.lease = std::stod(arg.substr(arg.find('=') + 1));
+            } else if (arg.rfind("--metrics=", 0) == 0) {
+                metrics = arg.substr(arg.find('=') + 1);
+            } else if (arg.rfind("--loadgen=", 0) == 0) {
+                load.path = arg.substr(arg.find('=') + 1);
+            } else if (arg.rfind("--connections=", 0) == 0) {
+                load.connections = std::stoul(arg.substr(arg.find('=') + 1));
+            } else if (arg.rfind("--rate=", 0) == 0) {
+                load.rate = std::stod(arg.substr(arg.find('=') + 1));
+            } else if (arg.rfind("--duration=", 0) == 0) {
+                load.duration = std::stod(arg.substr(arg.find('=') + 1));
+            } else if (arg.rfind("--", 0) == 0) {
+                throw std::runtime_error("Unknown option " + arg);
+            } else {
+                files.push_back(arg);
+            }
+        }
+        load.plan = *this;
+        batch.plan = *this;
+        batch.record = record;
+    }
+};
+
 int main(int argc, char* argv[]) try {
-    const std::string filename = (argc > 1 ? argv[1] : "");
-    if (filename == "--test") {
+    const Options options(argc, argv);
+    if (options.test) {
         // simple tests runner
         const auto tests = {
+            TestCase{"runner", test_runner, 0, true}, // global test options
             TestCase{"trim", test_trim},
             TestCase{"is_wall", test_is_wall},
+            TestCase{"transcode", test_transcode},
+            TestCase{"gzip", test_gzip},
+            TestCase{"compact_plan", test_compact_plan},
             TestCase{"chair_type", test_char_type},
+            TestCase{"dialect", [] { return for_plan_types([](auto plan) { return test_dialect<decltype(plan)>(); }); } },
+            TestCase{"doors", [] { return for_plan_types([](auto plan) { return test_doors<decltype(plan)>(); }); } },
+            TestCase{"sparse_grid", test_sparse_grid},
+            TestCase{"stats", test_stats, 0, true}, // global stats and metrics
+            TestCase{"capture", test_capture},
+            TestCase{"server", test_server, 0, true}, // global stats and metrics
+            TestCase{"metrics", test_metrics, 0, true}, // global stats and metrics
+            TestCase{"batch", test_batch},
+            TestCase{"thread_pool", test_thread_pool},
             TestCase{"room", test_room},
-            TestCase{"plan", test_plan},
+            TestCase{"compiled_plan", test_compiled_plan},
+            TestCase{"line_index", test_line_index},
+            TestCase{"route", test_route},
+            TestCase{"simulation", test_simulation},
+            TestCase{"clearance", test_clearance},
+            TestCase{"plan", [] { return for_plan_types([](auto plan) { return test_plan<decltype(plan)>(); }); } },
         };
         return run(tests) ? 0 : 1;
     }
 
-    // read plan
-    std::ifstream file(filename);
-    Plan plan;
-    plan.read(filename.empty() ? std::cin : file);
-
-    // find and print results
-    for (const Room& room : plan.find_chairs_in_rooms()) {
-        std::cout << room.name << ":\n" << room.chairs_str() << std::endl;
+    stats_enabled = options.stats;
+    if (!options.replay.empty()) {
+        replay(options.replay, options.max_speed, std::cout);
+    } else if (!options.serve.empty()) {
+        Server server(options.serve, options.record);
+        signal_server = &server;
+        std::signal(SIGINT, interrupt_server);
+        std::signal(SIGTERM, interrupt_server);
+        std::optional<MetricsEndpoint> metrics;
+        std::thread metrics_thread;
+        if (!options.metrics.empty()) {
+            stats_enabled = true;
+            metrics.emplace(options.metrics);
+            metrics_thread = std::thread(&MetricsEndpoint::run, &*metrics);
+        }
+        server.run();
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        signal_server = nullptr;
+        if (metrics) {
+            metrics->stop();
+            metrics_thread.join();
+        }
+    } else if (!options.batch.manifest.empty() && !options.batch.shard_dir.empty()) {
+        run_batch_worker(options.batch, std::cerr);
+    } else if (!options.batch.manifest.empty()) {
+        run_batch(options.batch, std::cout, std::cerr);
+    } else if (options.merge) {
+        std::vector<std::ifstream> files;
+        std::vector<std::istream*> inputs;
+        files.reserve(options.files.size());
+        for (const auto& filename : options.files) {
+            files.emplace_back(filename, std::ios::binary);
+            if (!files.back()) {
+                throw std::runtime_error("Can't read results " + filename);
+            }
+            inputs.push_back(&files.back());
+        }
+        if (inputs.empty()) {
+            inputs.push_back(&std::cin);
+        }
+        ResultWriter writer(std::cout, options.batch.format);
+        merge_results(inputs, writer);
+    } else if (!options.load.path.empty()) {
+        std::vector<std::string> corpus;
+        for (const auto& filename : options.files) {
+            std::ifstream file(filename, std::ios::binary);
+            corpus.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>{});
+        }
+        load_test(options.load, corpus).print(options.load, std::cout);
+    } else {
+        // read plan, find and print results
+        if (options.files.size() > 1) {
+            throw std::runtime_error("Only one plan file expected");
+        }
+        // plan files with an up to date line index are read partially
+        const std::string path = (options.files.empty() ? "" : options.files[0]);
+        std::optional<LineIndex> index;
+        if (path.empty() && (options.index || !options.region.empty())) {
+            throw std::runtime_error("Plan file expected for the line index");
+        } else if (!path.empty() && (options.index || !options.region.empty() || !options.room.empty())) {
+            index = (options.index ? std::nullopt : LineIndex::load(path));
+            if (!index && (options.index || !options.region.empty())) {
+                index = LineIndex::build(path, options);
+            }
+        }
+        std::ifstream file(path, std::ios::binary);
+        std::istream* source = (options.files.empty() ? &std::cin : &file);
+        std::optional<GzipIstream> gzip;
+        if (is_gzip(*source)) {
+            source = &gzip.emplace(*source);
+        }
+        std::istream& input = *source;
+        if (options.index) {
+            index->save(path);
+            std::cout << "indexed " << index->lines() << " lines, " << index->rooms.size() << " rooms" << std::endl;
+        } else if (!options.region.empty()) {
+            Pos first, last;
+            char c1 = 0, c2 = 0, c3 = 0;
+            std::istringstream region(options.region);
+            if (!(region >> first.x >> c1 >> first.y >> c2 >> last.x >> c3 >> last.y) || c1 != ',' || c2 != ',' || c3 != ',') {
+                throw std::runtime_error("Invalid region " + options.region);
+            }
+            std::cout << index->read_region(path, first, last);
+        } else if (index && !options.room.empty()) {
+            process_indexed_room_query(path, *index, options, options.room, std::cout);
+        } else if (!options.convert.empty()) {
+            if (options.convert != "compact" && options.convert != "text") {
+                throw std::runtime_error("Unknown plan format " + options.convert);
+            }
+            convert_plan(input, std::cout, options.convert == "compact");
+        } else if (!options.room.empty()) {
+            process_room_query(input, options, options.room, std::cout);
+        } else if (options.clearance) {
+            process_clearance(input, options, options.simulation.entrance, options.footprints, std::cout);
+        } else if (options.simulation.workers > 0) {
+            process_simulation(input, options, options.simulation, std::cout);
+        } else if (!options.route.empty()) {
+            Pos from, to;
+            char c1 = 0, c2 = 0, c3 = 0;
+            std::istringstream route(options.route);
+            if (!(route >> from.x >> c1 >> from.y >> c2 >> to.x >> c3 >> to.y) || c1 != ',' || c2 != ',' || c3 != ',') {
+                throw std::runtime_error("Invalid route " + options.route);
+            }
+            process_route_query(input, options, from, to, std::cout);
+        } else if (!options.record.empty()) {
+            CaptureRecord record{CaptureRecord::now(), options, std::string{std::istreambuf_iterator<char>(input), {}}};
+            std::ostringstream data;
+            record.write(data);
+            append_file(options.record, CaptureMagic, data.str());
+            std::istringstream recorded(record.plan);
+            process_plan(recorded, options, std::cout);
+        } else {
+            process_plan(input, options, std::cout);
+        }
+    }
+    if (options.stats) {
+        PhaseScope other(Phase::Other); // account the last phase time
+        print_stats(std::cerr);
     }
     return 0;
 } catch (const std::exception& ex) {
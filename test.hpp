@@ -1,27 +1,121 @@
 #pragma once
 
 #include <iostream>
+#include <sstream>
 #include <functional>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
 
 struct TestCase {
     std::string name;
     std::function<bool()> test;
+    double budget = 0; // seconds, 0 for the default budget of TestOptions
+    bool serial = false; // not run concurrently with other tests
 };
 
+struct TestOptions {
+    size_t threads = 1; // run top level tests on several threads
+    size_t repeat = 1; // run tests without nested tests several times for timing
+    double budget = 0; // seconds a test without nested tests may take, 0 for no limit
+    bool timing = false; // print test durations
+};
+
+inline TestOptions test_options;
+
+inline thread_local std::ostream* test_output = &std::cout; // output of the running test
+inline thread_local size_t test_depth = 0; // nesting level of the running test
+inline thread_local size_t test_runs = 0; // started run() calls, to find tests without nested tests
+
+// Run the test with its nested tests output written to out, returns success
+inline bool run_test(const TestCase& t, const char* prefix, std::ostream& out) {
+    using Clock = std::chrono::steady_clock;
+    std::ostream* const parent = test_output;
+    test_output = &out;
+    ++test_depth;
+    out << prefix << t.name << ": ";
+    bool ok = false;
+    double min = 0, total = 0; // seconds
+    size_t count = 0;
+    bool leaf = false;
+    try {
+        const size_t runs = test_runs;
+        do {
+            const auto start = Clock::now();
+            ok = t.test() && (ok || count == 0);
+            const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+            min = (count == 0 ? elapsed : std::min(min, elapsed));
+            total += elapsed;
+            leaf = (test_runs == runs);
+        } while (leaf && ++count < test_options.repeat);
+        count = std::max<size_t>(count, 1);
+        out << (ok ? " OK" : " FAIL");
+    } catch (const std::exception& ex) {
+        out << "exception: " << ex.what();
+        ok = false;
+    } catch (...) {
+        out << "Unknown exception";
+        ok = false;
+    }
+    --test_depth;
+    test_output = parent;
+
+    const double budget = (t.budget > 0 ? t.budget : leaf ? test_options.budget : 0);
+    if (ok && budget > 0 && min > budget) {
+        out << " SLOW (" << min * 1e3 << " ms > " << budget * 1e3 << " ms)";
+        ok = false;
+    }
+    if (test_options.timing) {
+        if (count > 1) {
+            out << " (min " << min * 1e3 << " ms, mean " << total / count * 1e3 << " ms, " << count << " runs)";
+        } else {
+            out << " (" << min * 1e3 << " ms)";
+        }
+    }
+    return ok;
+}
+
+// Run tests, independent top level tests on test_options.threads threads.
+// Output is written in the tests order
 inline bool run(std::initializer_list<TestCase> tests, const char* prefix = "\n") {
-    size_t success = 0;
-    for (const auto& t : tests) {
-        try {
-            std::cout << prefix << t.name << ": ";
-            const bool ok = t.test();
-            success += ok;
-            std::cout << (ok ? " OK" : " FAIL");
-        } catch (const std::exception& ex) {
-            std::cout << "exception: " << ex.what();
-        } catch (...) {
-            std::cout << "Unknown exception";
+    ++test_runs;
+    const TestCase* const cases = tests.begin();
+    std::vector<std::string> outputs(tests.size());
+    std::vector<char> done(tests.size()), success(tests.size());
+
+    if (test_depth == 0 && test_options.threads > 1) {
+        std::atomic<size_t> next{0};
+        const auto worker = [&] {
+            for (size_t i; (i = next++) < tests.size();) {
+                if (!cases[i].serial) {
+                    std::ostringstream out;
+                    success[i] = run_test(cases[i], prefix, out);
+                    outputs[i] = out.str();
+                    done[i] = true;
+                }
+            }
+        };
+        std::vector<std::thread> threads(test_options.threads);
+        for (auto& thread : threads) {
+            thread = std::thread(worker);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // serial tests run after the parallel ones
+    std::ostream& out = *test_output;
+    for (size_t i = 0; i < tests.size(); ++i) {
+        if (done[i]) {
+            out << outputs[i];
+        } else {
+            success[i] = run_test(cases[i], prefix, out);
         }
     }
-    std::cout << std::endl;
-    return success == tests.size();
+    out << std::endl;
+    return std::all_of(success.begin(), success.end(), [](char ok) { return ok; });
 }